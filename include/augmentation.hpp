@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <cstddef>
+#include <limits>
+
+namespace avl_tree {
+
+// An augmentation keeps a monoid value per node summarising its subtree,
+// so AVLTree::RangeAggregate folds any key range in O(log n):
+//   Value     the summary type
+//   Identity  the neutral element of Combine
+//   Lift      summary of one key inserted count times
+//   Combine   summary of two adjacent key runs, left before right; it has to
+//             be associative but need not be commutative
+// Keys may carry a payload that Compare ignores, Lift can read it.
+template <typename A, typename T>
+concept AugmentationFor = requires(const T &key, size_t count,
+                                   const typename A::Value &value) {
+    { A::Identity() } -> std::convertible_to<typename A::Value>;
+    { A::Lift(key, count) } -> std::convertible_to<typename A::Value>;
+    { A::Combine(value, value) } -> std::convertible_to<typename A::Value>;
+};
+
+// the default, nodes keep nothing beyond their subtree size
+struct NoAugmentation final {
+    struct Value final {};
+
+    static Value Identity() { return {}; }
+    template <typename T>
+    static Value Lift(const T &, size_t) {
+        return {};
+    }
+    static Value Combine(Value, Value) { return {}; }
+};
+
+// sum of the keys, repeats included
+template <typename T>
+struct SumAugmentation final {
+    using Value = T;
+
+    static Value Identity() { return T{}; }
+    static Value Lift(const T &key, size_t count) {
+        return count == 1 ? key : key * static_cast<T>(count);
+    }
+    static Value Combine(const Value &left, const Value &right) {
+        return left + right;
+    }
+};
+
+// smallest key, numeric_limits<T>::max() for an empty range
+template <typename T>
+struct MinAugmentation final {
+    using Value = T;
+
+    static Value Identity() { return std::numeric_limits<T>::max(); }
+    static Value Lift(const T &key, size_t) { return key; }
+    static Value Combine(const Value &left, const Value &right) {
+        return std::min(left, right);
+    }
+};
+
+// largest key, numeric_limits<T>::lowest() for an empty range
+template <typename T>
+struct MaxAugmentation final {
+    using Value = T;
+
+    static Value Identity() { return std::numeric_limits<T>::lowest(); }
+    static Value Lift(const T &key, size_t) { return key; }
+    static Value Combine(const Value &left, const Value &right) {
+        return std::max(left, right);
+    }
+};
+
+}  // namespace avl_tree
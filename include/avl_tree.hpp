@@ -1,312 +1,1401 @@
+#pragma once
+
 #include <glog/logging.h>
 
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <compare>
+#include <concepts>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <iterator>
 #include <memory>
-#include <stack>
+#include <optional>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "augmentation.hpp"
+#include "frozen_range_index.hpp"
+#include "node_arena.hpp"
+#include "node_layout.hpp"
+#include "snapshot.hpp"
+#include "thread_pool.hpp"
 #include "tree_exceptions.hpp"
+#include "tree_stats.hpp"
 namespace avl_tree {
 
+using avl_tree::IndexOutOfRangeException;
 using avl_tree::NodeNullException;
-template <typename T>
+
+// Compare::is_transparent enables lookups by any key type Compare accepts
+template <typename Compare>
+concept TransparentCompare = requires { typename Compare::is_transparent; };
+
+// Keys are ordered by Compare, as in std::set. In multiset mode (kMultiset)
+// every node stores how many times its key was inserted, subtree sizes and
+// all counts include the repeats. Augment
+// keeps a per-node summary for RangeAggregate, see augmentation.hpp. Small
+// arithmetic keys in set mode without one get the packed CompactNode layout.
+template <typename T, typename Compare = std::less<T>,
+          typename NodeStorage = ArenaStorage<>, bool kMultiset = false,
+          AugmentationFor<T> Augment = NoAugmentation>
 class AVLTree final {
    private:
-    struct Node final {
-        T key_;
-        std::unique_ptr<Node> left_;
-        std::unique_ptr<Node> right_;
-        int height_ = 1;
-        size_t desc_size = 1;  // Size of the subtree rooted at this node
-        explicit Node(const T &key) : key_(key) {}
-    };
+    using Node = NodeFor<T, kMultiset, Augment>;
+    using Aggregate = typename Augment::Value;
+    static constexpr bool kAugmented = !std::is_same_v<Augment, NoAugmentation>;
+    using Pool = typename NodeStorage::template Pool<Node>;
 
-    std::unique_ptr<Node> root_;
+    // an AVL tree over 2^32 nodes is less than 1.45 * 32 levels deep
+    static constexpr int kMaxHeight = 64;
 
-    // destroy tree without recursion
-    void Clear() {
-        if (!root_) return;
+    // descents a batch runs side by side, enough to keep the core's line
+    // fill buffers busy
+    static constexpr size_t kLockstepLanes = 16;
+    // below about this much node memory the tree sits in L2/L3 anyway and
+    // lockstep bookkeeping costs more than the overlapped misses save
+    static constexpr size_t kLockstepMinBytes = size_t{4} << 20;
+
+    // Trees produced by Split share their pool until one side is joined
+    // elsewhere or destroyed. The pool is created on the first allocation.
+    std::shared_ptr<Pool> arena_;
+    NodeIndex root_ = kNullIndex;
+    uint64_t version_ = 0;  // see Version
+    [[no_unique_address]] Compare compare_;
+    // empty unless built with AVL_TREE_STATS, see tree_stats.hpp
+    [[no_unique_address]] mutable TreeStats stats_;
+
+    // std::less orders like the key types' own <=>
+    static constexpr bool kNaturalOrder =
+        std::is_same_v<Compare, std::less<T>> ||
+        std::is_same_v<Compare, std::less<>>;
+
+    // How key orders against a node's key. One three-way comparison where
+    // Compare is std::less and the types have <=>, which halves the calls
+    // for keys such as strings; two Compare calls otherwise.
+    template <typename K>
+    std::weak_ordering Order(const K &key, const T &node_key) const {
+        stats_.Record(TreeEvent::kComparison);
+        if constexpr (kNaturalOrder && std::three_way_comparable_with<
+                                           K, T, std::weak_ordering>) {
+            return key <=> node_key;
+        } else {
+            if (compare_(key, node_key)) return std::weak_ordering::less;
+            if (compare_(node_key, key)) return std::weak_ordering::greater;
+            return std::weak_ordering::equivalent;
+        }
+    }
+
+    Node &At(NodeIndex index) { return (*arena_)[index]; }
+    const Node &At(NodeIndex index) const { return (*arena_)[index]; }
 
-        std::stack<std::unique_ptr<Node>> stack;
-        stack.push(std::move(root_));
+    template <typename Key>
+    NodeIndex NewNode(Key &&key) {
+        if (!arena_) {
+            arena_ = std::make_shared<Pool>();
+        }
+        return arena_->Allocate(std::forward<Key>(key));
+    }
+
+    // returns every node of the subtree to the arena without recursion
+    void DestroySubtree(NodeIndex root) {
+        std::vector<NodeIndex> stack;
+        if (root != kNullIndex) stack.push_back(root);
 
         while (!stack.empty()) {
-            std::unique_ptr<Node> node = std::move(stack.top());
-            stack.pop();
+            NodeIndex node = stack.back();
+            stack.pop_back();
 
-            if (node->right_) {
-                stack.push(std::move(node->right_));
+            if (At(node).Right() != kNullIndex) {
+                stack.push_back(At(node).Right());
             }
-            if (node->left_) {
-                stack.push(std::move(node->left_));
+            if (At(node).Left() != kNullIndex) {
+                stack.push_back(At(node).Left());
             }
+            arena_->Deallocate(node);
         }
     }
-    void UpdateSubSize(const std::unique_ptr<Node> &node) {
-        assert(node != nullptr);
-        node->desc_size = 1 + (node->left_ ? node->left_->desc_size : 0) +
-                          (node->right_ ? node->right_->desc_size : 0);
+
+    // destroy tree without recursion, storage goes away block by block
+    // unless the pool is still shared with another tree
+    void Clear() {
+        if (!arena_) return;
+
+        if (arena_.use_count() > 1) {
+            DestroySubtree(root_);
+            arena_.reset();
+        } else {
+            if constexpr (!std::is_trivially_destructible_v<Node>) {
+                DestroySubtree(root_);
+            }
+            arena_->Release();
+        }
+        root_ = kNullIndex;
+    }
+    // recomputes the subtree size, and the aggregate if there is one, from
+    // the node's children
+    void UpdateSummary(NodeIndex node) {
+        assert(node != kNullIndex);
+        Node &current = At(node);
+        current.SetSubSize(current.Count() + GetSubSize(current.Left()) +
+                           GetSubSize(current.Right()));
+        if constexpr (kAugmented) {
+            current.SetAggregate(Augment::Combine(
+                Augment::Combine(GetAggregate(current.Left()),
+                                 Augment::Lift(current.key_, current.Count())),
+                GetAggregate(current.Right())));
+        }
     }
 
-    int GetHeight(const std::unique_ptr<Node> &node) const {
-        return node ? node->height_ : 0;
+    Aggregate GetAggregate(NodeIndex node) const {
+        return node != kNullIndex ? At(node).Aggregate() : Augment::Identity();
+    }
+
+    // the occurrences below path[0, depth) changed by delta without moving a
+    // node, only sizes and aggregates along the path are refreshed
+    void RefreshPath(const NodeIndex *path, int depth, std::ptrdiff_t delta) {
+        for (int i = depth - 1; i >= 0; --i) {
+            Node &ancestor = At(path[i]);
+            ancestor.SetSubSize(ancestor.SubSize() +
+                                static_cast<size_t>(delta));
+            if constexpr (kAugmented) {
+                UpdateSummary(path[i]);
+            }
+        }
     }
 
-    T GetKey(const std::unique_ptr<Node> &node) const {
-        assert(node != nullptr);
-        return node->key_;
+    int GetHeight(NodeIndex node) const {
+        return node != kNullIndex ? At(node).Height() : 0;
     }
 
-    int GetBalance(const std::unique_ptr<Node> &node) const {
-        return node ? GetHeight(node->left_) - GetHeight(node->right_) : 0;
+    KeyArg<T> GetKey(NodeIndex node) const {
+        assert(node != kNullIndex);
+        return At(node).key_;
     }
 
-    bool VerifyBalance(const std::unique_ptr<Node> &node) const {
-        assert(node != nullptr);
+    int GetBalance(NodeIndex node) const {
+        return node != kNullIndex
+                   ? GetHeight(At(node).Left()) - GetHeight(At(node).Right())
+                   : 0;
+    }
+
+    bool VerifyBalance(NodeIndex node) const {
+        assert(node != kNullIndex);
         return std::abs(GetBalance(node)) <= 1;
     }
 
-    void UpdateHeight(const std::unique_ptr<Node> &node) {
-        assert(node != nullptr);
-        node->height_ =
-            1 + std::max(GetHeight(node->left_), GetHeight(node->right_));
+    void UpdateHeight(NodeIndex node) {
+        assert(node != kNullIndex);
+        At(node).SetHeight(1 + std::max(GetHeight(At(node).Left()),
+                                        GetHeight(At(node).Right())));
     }
 
-    std::unique_ptr<Node> RotateRight(std::unique_ptr<Node> y) {
-        auto x = std::move(y->left_);
-        auto T2 = std::move(x->right_);
+    NodeIndex RotateRight(NodeIndex y) {
+        stats_.Record(TreeEvent::kRightRotation);
+        NodeIndex x = At(y).Left();
+        NodeIndex T2 = At(x).Right();
 
-        x->right_ = std::move(y);
-        x->right_->left_ = std::move(T2);
+        At(x).SetRight(y);
+        At(y).SetLeft(T2);
 
-        UpdateHeight(x->right_);
-        UpdateSubSize(x->right_);
+        UpdateHeight(y);
+        UpdateSummary(y);
         UpdateHeight(x);
-        UpdateSubSize(x);
+        UpdateSummary(x);
 
         return x;
     }
 
-    std::unique_ptr<Node> RotateLeft(std::unique_ptr<Node> x) {
-        auto y = std::move(x->right_);
-        auto T2 = std::move(y->left_);
+    NodeIndex RotateLeft(NodeIndex x) {
+        stats_.Record(TreeEvent::kLeftRotation);
+        NodeIndex y = At(x).Right();
+        NodeIndex T2 = At(y).Left();
 
-        y->left_ = std::move(x);
-        y->left_->right_ = std::move(T2);
+        At(y).SetLeft(x);
+        At(x).SetRight(T2);
 
-        UpdateHeight(y->left_);
-        UpdateSubSize(y->left_);
+        UpdateHeight(x);
+        UpdateSummary(x);
         UpdateHeight(y);
-        UpdateSubSize(y);
+        UpdateSummary(y);
 
         return y;
     }
 
-    std::unique_ptr<Node> Balance(std::unique_ptr<Node> node) {
-        assert(node != nullptr);
+    NodeIndex Balance(NodeIndex node) {
+        assert(node != kNullIndex);
         UpdateHeight(node);
-        UpdateSubSize(node);
+        UpdateSummary(node);
         int balance = GetBalance(node);
 
         if (balance > 1) {
-            if (GetBalance(node->left_) < 0) {
-                node->left_ = RotateLeft(std::move(node->left_));
+            if (GetBalance(At(node).Left()) < 0) {
+                At(node).SetLeft(RotateLeft(At(node).Left()));
             }
-            return RotateRight(std::move(node));
+            return RotateRight(node);
         }
 
         if (balance < -1) {
-            if (GetBalance(node->right_) > 0) {
-                node->right_ = RotateRight(std::move(node->right_));
+            if (GetBalance(At(node).Right()) > 0) {
+                At(node).SetRight(RotateRight(At(node).Right()));
             }
-            return RotateLeft(std::move(node));
+            return RotateLeft(node);
         }
 
         return node;
     }
 
-    std::unique_ptr<Node> InsertNode(std::unique_ptr<Node> node, const T &key) {
-        if (!node) {
-            return std::make_unique<Node>(key);
+    size_t GetSubSize(NodeIndex node) const {
+        return node != kNullIndex ? At(node).SubSize() : 0;
+    }
+
+    const Node *GetNodePtr(NodeIndex node) const {
+        return node != kNullIndex ? &At(node) : nullptr;
+    }
+
+    void Prefetch(NodeIndex node) const { __builtin_prefetch(&At(node)); }
+
+    // one CountBelow descent of a lockstep batch
+    template <typename K>
+    struct Descent final {
+        const K *key = nullptr;
+        bool inclusive = false;
+        NodeIndex node = kNullIndex;
+        NodeIndex left = kNullIndex;  // its size is added next round
+        size_t count = 0;
+    };
+
+    // Runs the CountBelow descents of lanes side by side, one level per
+    // round. Each round only prefetches what the next one reads (the next
+    // node and the left child whose size is due), so the cache misses of
+    // all lanes are in flight together where a lone descent waits for one
+    // miss at a time.
+    template <typename K>
+    void DescendInLockstep(std::span<Descent<K>> lanes) const {
+        [[maybe_unused]] uint64_t visited = 0;
+        bool active = root_ != kNullIndex;
+        for (Descent<K> &lane : lanes) {
+            lane.node = root_;
         }
 
-        if (key < node->key_) {
-            node->left_ = InsertNode(std::move(node->left_), key);
-        } else if (node->key_ < key) {
-            node->right_ = InsertNode(std::move(node->right_), key);
-        } else {
-            return node;  // don't allow duplicates
+        while (active) {
+            active = false;
+            for (Descent<K> &lane : lanes) {
+                if (lane.left != kNullIndex) {
+                    lane.count += At(lane.left).SubSize();
+                    lane.left = kNullIndex;
+                }
+                if (lane.node == kNullIndex) continue;
+
+                const Node &current = At(lane.node);
+                if constexpr (kStatsEnabled) ++visited;
+                bool goes_right = lane.inclusive
+                                      ? !compare_(*lane.key, current.key_)
+                                      : compare_(current.key_, *lane.key);
+                if (goes_right) {
+                    lane.count += current.Count();
+                    lane.left = current.Left();
+                    lane.node = current.Right();
+                    if (lane.left != kNullIndex) Prefetch(lane.left);
+                } else {
+                    lane.node = current.Left();
+                }
+                if (lane.node != kNullIndex) Prefetch(lane.node);
+                active |= lane.node != kNullIndex || lane.left != kNullIndex;
+            }
+        }
+        stats_.Record(TreeEvent::kNodeVisit, visited);
+        stats_.Record(TreeEvent::kComparison, visited);
+    }
+
+    // number of keys below key (kInclusive: below or equal), one descent
+    template <bool kInclusive, typename K>
+    [[nodiscard]] size_t CountBelow(const K &key) const {
+        size_t count = 0;
+        [[maybe_unused]] uint64_t visited = 0;
+        NodeIndex node = root_;
+        while (node != kNullIndex) {
+            const Node &current = At(node);
+            if constexpr (kStatsEnabled) ++visited;
+            bool goes_right = kInclusive ? !compare_(key, current.key_)
+                                         : compare_(current.key_, key);
+            if (goes_right) {
+                count += current.Count() + GetSubSize(current.Left());
+                node = current.Right();
+            } else {
+                node = current.Left();
+            }
         }
+        stats_.Record(TreeEvent::kNodeVisit, visited);
+        stats_.Record(TreeEvent::kComparison, visited);
+        return count;
+    }
 
-        return Balance(std::move(node));
+    // in-order iterator at the first key above key (kStrict) or not below it
+    template <bool kStrict, typename K>
+    auto SeekInOrder(const K &key) const {
+        InOrderIterator it(arena_.get(), kNullIndex);
+        NodeIndex node = root_;
+        while (node != kNullIndex) {
+            const Node &current = At(node);
+            bool in_range = kStrict ? compare_(key, current.key_)
+                                    : !compare_(current.key_, key);
+            if (in_range) {
+                it.Push(node);
+                node = current.Left();
+            } else {
+                node = current.Right();
+            }
+        }
+        return it;
     }
 
-    [[nodiscard]] size_t RangeQueryInternal(const Node *node, const T &min,
-                                            const T &max) const {
-        if (!node) return 0;
-        // LOG(INFO) << "Node key: " << node->key_;
-        if (node->key_ < min)
-            return RangeQueryInternal(node->right_.get(), min, max);
+    // Hangs left and right below node. Whichever side is more than one
+    // level taller is descended along its inner spine and rebalanced on the
+    // way back, so the cost is O(|height(left) - height(right)| + 1).
+    NodeIndex JoinWithKey(NodeIndex left, NodeIndex node, NodeIndex right) {
+        int left_height = GetHeight(left);
+        int right_height = GetHeight(right);
 
-        if (node->key_ > max)
-            return RangeQueryInternal(node->left_.get(), min, max);
+        if (left_height > right_height + 1) {
+            At(left).SetRight(JoinWithKey(At(left).Right(), node, right));
+            return Balance(left);
+        }
+        if (right_height > left_height + 1) {
+            At(right).SetLeft(JoinWithKey(left, node, At(right).Left()));
+            return Balance(right);
+        }
 
-        size_t left_count = RangeQueryInternal(node->left_.get(), min, max);
-        size_t right_count = RangeQueryInternal(node->right_.get(), min, max);
-        // LOG(INFO) << ", Left count: " << left_count << ", Right count: " <<
-        // right_count;
-        return 1 + left_count + right_count;
+        At(node).SetLeft(left);
+        At(node).SetRight(right);
+        UpdateHeight(node);
+        UpdateSummary(node);
+        return node;
     }
 
-   public:
-    AVLTree() = default;
+    // unlinks the smallest node of the subtree into min
+    NodeIndex DetachMin(NodeIndex node, NodeIndex &min) {
+        if (At(node).Left() == kNullIndex) {
+            min = node;
+            return At(node).Right();
+        }
+        At(node).SetLeft(DetachMin(At(node).Left(), min));
+        return Balance(node);
+    }
 
-    ~AVLTree() { Clear(); }
-    void Insert(const T &key) { root_ = InsertNode(std::move(root_), key); }
+    // concatenates two subtrees, every key of left is below every key of right
+    NodeIndex Join(NodeIndex left, NodeIndex right) {
+        if (left == kNullIndex) return right;
+        if (right == kNullIndex) return left;
 
-    class AVLIterator;
+        NodeIndex min = kNullIndex;
+        NodeIndex rest = DetachMin(right, min);
+        return JoinWithKey(left, min, rest);
+    }
 
-    // abstract base class for traversal strategies
-    class TraversalStrategy {
-       public:
-        virtual void Init(const Node *root,
-                          std::stack<const Node *> &stack) = 0;
-        virtual void Next(std::stack<const Node *> &stack) = 0;
-        virtual const Node *Current(
-            const std::stack<const Node *> &stack) const = 0;
-        virtual bool IsDone(const std::stack<const Node *> &stack) const = 0;
-        virtual ~TraversalStrategy() = default;
-    };
+    template <typename K>
+    size_t CountOf(const K &key) const {
+        NodeIndex node = root_;
+        while (node != kNullIndex) {
+            const Node &current = At(node);
+            std::weak_ordering order = Order(key, current.key_);
+            if (order < 0) {
+                node = current.Left();
+            } else if (order > 0) {
+                node = current.Right();
+            } else {
+                return current.Count();
+            }
+        }
+        return 0;
+    }
 
-    class PreOrderStrategy final : public TraversalStrategy {
-       public:
-        void Init(const Node *root, std::stack<const Node *> &stack) override {
-            if (root) {
-                stack.push(root);
+    template <typename K>
+    std::optional<size_t> RankOf(const K &key) const {
+        size_t count = 0;
+        NodeIndex node = root_;
+        while (node != kNullIndex) {
+            const Node &current = At(node);
+            std::weak_ordering order = Order(key, current.key_);
+            if (order < 0) {
+                node = current.Left();
+            } else if (order > 0) {
+                count += current.Count() + GetSubSize(current.Left());
+                node = current.Right();
+            } else {
+                return count + GetSubSize(current.Left());
+            }
+        }
+        return std::nullopt;
+    }
+
+    template <typename K>
+    size_t RangeCount(const K &min, const K &max) const {
+        stats_.Record(TreeEvent::kRangeQuery);
+        if (root_ == kNullIndex || compare_(max, min)) {
+            // If tree is empty or min_key > max_key
+            return 0;
+        }
+
+        return CountBelow<true>(max) - CountBelow<false>(min);
+    }
+
+    // Folds [min, max] in key order. Below the first node inside the range
+    // the two boundary paths pick up whole subtrees by their stored
+    // aggregates, so O(log n) nodes are touched.
+    template <typename K>
+    Aggregate AggregateRange(const K &min, const K &max) const {
+        NodeIndex split = root_;
+        while (split != kNullIndex) {
+            const Node &current = At(split);
+            if (compare_(current.key_, min)) {
+                split = current.Right();
+            } else if (compare_(max, current.key_)) {
+                split = current.Left();
+            } else {
+                break;
             }
         }
+        if (split == kNullIndex) return Augment::Identity();
 
-        void Next(std::stack<const Node *> &stack) override {
-            if (!stack.empty()) {
-                const Node *current = stack.top();
-                stack.pop();
-                if (current->right_) stack.push(current->right_.get());
-                if (current->left_) stack.push(current->left_.get());
+        // keys not below min in the left subtree, found right to left
+        Aggregate left = Augment::Identity();
+        for (NodeIndex node = At(split).Left(); node != kNullIndex;) {
+            const Node &current = At(node);
+            if (compare_(current.key_, min)) {
+                node = current.Right();
+                continue;
             }
+            left = Augment::Combine(
+                Augment::Combine(Augment::Lift(current.key_, current.Count()),
+                                 GetAggregate(current.Right())),
+                left);
+            node = current.Left();
         }
 
-        const Node *Current(
-            const std::stack<const Node *> &stack) const override {
-            return stack.empty() ? nullptr : stack.top();
+        // keys not above max in the right subtree, found left to right
+        Aggregate right = Augment::Identity();
+        for (NodeIndex node = At(split).Right(); node != kNullIndex;) {
+            const Node &current = At(node);
+            if (compare_(max, current.key_)) {
+                node = current.Left();
+                continue;
+            }
+            right = Augment::Combine(
+                right, Augment::Combine(GetAggregate(current.Left()),
+                                        Augment::Lift(current.key_,
+                                                      current.Count())));
+            node = current.Right();
         }
 
-        bool IsDone(const std::stack<const Node *> &stack) const override {
-            return stack.empty();
+        const Node &middle = At(split);
+        return Augment::Combine(
+            Augment::Combine(left, Augment::Lift(middle.key_, middle.Count())),
+            right);
+    }
+
+    // splits the subtree into keys below key (kInclusive: or equal) and the
+    // rest in O(log n)
+    template <bool kInclusive>
+    std::pair<NodeIndex, NodeIndex> SplitAt(NodeIndex node, KeyArg<T> key) {
+        if (node == kNullIndex) return {kNullIndex, kNullIndex};
+
+        Node &current = At(node);
+        NodeIndex left = current.Left();
+        NodeIndex right = current.Right();
+        bool goes_left = kInclusive ? !compare_(key, current.key_)
+                                    : compare_(current.key_, key);
+        if (goes_left) {
+            auto [below, rest] = SplitAt<kInclusive>(right, key);
+            return {JoinWithKey(left, node, below), rest};
         }
-    };
+        auto [below, rest] = SplitAt<kInclusive>(left, key);
+        return {below, JoinWithKey(rest, node, right)};
+    }
 
-    class InOrderStrategy final : public TraversalStrategy {
-       public:
-        void Init(const Node *root, std::stack<const Node *> &stack) override {
-            PushLeftmost(root, stack);
+    // builds a perfectly balanced subtree over sorted unique keys[lo, hi),
+    // nodes are allocated in pre-order so a descent walks forward in memory.
+    // counts holds the multiplicities in multiset mode and is empty otherwise
+    NodeIndex BuildBalanced(std::vector<T> &keys,
+                            const std::vector<size_t> &counts, size_t lo,
+                            size_t hi) {
+        if (lo == hi) return kNullIndex;
+
+        size_t mid = lo + (hi - lo) / 2;
+        NodeIndex node = NewNode(std::move(keys[mid]));
+        if constexpr (kMultiset) {
+            At(node).SetCount(counts[mid]);
         }
+        NodeIndex left = BuildBalanced(keys, counts, lo, mid);
+        NodeIndex right = BuildBalanced(keys, counts, mid + 1, hi);
+
+        At(node).SetLeft(left);
+        At(node).SetRight(right);
+        UpdateHeight(node);
+        UpdateSummary(node);
+        return node;
+    }
 
-        void Next(std::stack<const Node *> &stack) override {
-            if (!stack.empty()) {
-                const Node *current = stack.top();
-                stack.pop();
-                PushLeftmost(current->right_.get(), stack);
+    // moves every key out of the tree in sorted order, multiplicities go to
+    // counts in multiset mode
+    template <typename Visit>
+    void ForEachNodeInOrder(Visit visit) const {
+        std::vector<NodeIndex> stack;
+        NodeIndex node = root_;
+        while (node != kNullIndex || !stack.empty()) {
+            while (node != kNullIndex) {
+                stack.push_back(node);
+                node = At(node).Left();
             }
+            node = stack.back();
+            stack.pop_back();
+            visit(node);
+            node = At(node).Right();
         }
+    }
 
-        const Node *Current(
-            const std::stack<const Node *> &stack) const override {
-            return stack.empty() ? nullptr : stack.top();
+    void MoveOutInOrder(std::vector<T> &out, std::vector<size_t> &counts) {
+        ForEachNodeInOrder([&](NodeIndex node) {
+            out.push_back(std::move(At(node).key_));
+            if constexpr (kMultiset) {
+                counts.push_back(At(node).Count());
+            }
+        });
+    }
+
+    // sorts keys and folds equal ones together, returns the multiplicities
+    // in multiset mode and an empty vector otherwise
+    std::vector<size_t> SortAndGroup(std::vector<T> &keys) const {
+        if (!std::is_sorted(keys.begin(), keys.end(), compare_)) {
+            std::sort(keys.begin(), keys.end(), compare_);
         }
 
-        bool IsDone(const std::stack<const Node *> &stack) const override {
-            return stack.empty();
+        std::vector<size_t> counts;
+        size_t unique = 0;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (unique > 0 && !compare_(keys[unique - 1], keys[i])) {
+                if constexpr (kMultiset) {
+                    ++counts.back();
+                }
+                continue;
+            }
+            if (unique != i) {
+                keys[unique] = std::move(keys[i]);
+            }
+            ++unique;
+            if constexpr (kMultiset) {
+                counts.push_back(1);
+            }
         }
+        keys.erase(keys.begin() + unique, keys.end());
+        return counts;
+    }
 
-       private:
-        void PushLeftmost(const Node *node, std::stack<const Node *> &stack) {
-            while (node) {
-                stack.push(node);
-                node = node->left_.get();
+    // Inserts count occurrences of key (count is 1 outside multiset mode).
+    // The descent path is kept in on-stack arrays and rebalancing stops at
+    // the first ancestor whose height is unchanged, the nodes above only get
+    // their sizes bumped.
+    bool InsertOccurrences(KeyArg<T> key, size_t count) {
+        NodeIndex path[kMaxHeight];
+        bool went_left[kMaxHeight];
+        int depth = 0;
+
+        NodeIndex node = root_;
+        while (node != kNullIndex) {
+            Node &current = At(node);
+            assert(depth < kMaxHeight);
+            std::weak_ordering order = Order(key, current.key_);
+            if (order < 0) {
+                went_left[depth] = true;
+            } else if (order > 0) {
+                went_left[depth] = false;
+            } else if constexpr (kMultiset) {
+                current.SetCount(current.Count() + count);
+                path[depth] = node;
+                RefreshPath(path, depth + 1,
+                            static_cast<std::ptrdiff_t>(count));
+                ++version_;
+                return true;
+            } else {
+                stats_.Record(TreeEvent::kDuplicateInsert);
+                return false;  // don't allow duplicates
             }
+            path[depth] = node;
+            node = went_left[depth] ? current.Left() : current.Right();
+            ++depth;
         }
-    };
 
+        NodeIndex subtree = NewNode(key);
+        At(subtree).SetCount(count);
+        UpdateSummary(subtree);
+        ++version_;
+        while (depth > 0) {
+            --depth;
+            Node &parent = At(path[depth]);
+            parent.SetChild(went_left[depth], subtree);
+
+            int old_height = parent.Height();
+            subtree = Balance(path[depth]);
+            if (At(subtree).Height() == old_height) {
+                if (depth == 0) break;
+                Node &above = At(path[depth - 1]);
+                above.SetChild(went_left[depth - 1], subtree);
+                RefreshPath(path, depth, static_cast<std::ptrdiff_t>(count));
+                return true;
+            }
+        }
+        root_ = subtree;
+        stats_.RecordHeight(At(root_).Height());
+        return true;
+    }
+
+    const T &MinKey() const {
+        NodeIndex node = root_;
+        while (At(node).Left() != kNullIndex) {
+            node = At(node).Left();
+        }
+        return At(node).key_;
+    }
+
+    const T &MaxKey() const {
+        NodeIndex node = root_;
+        while (At(node).Right() != kNullIndex) {
+            node = At(node).Right();
+        }
+        return At(node).key_;
+    }
+
+    // checks order, heights, balance and sizes of the subtree, returns its
+    // height or -1 when something is off
+    int CheckSubtree(NodeIndex node, const T *min, const T *max) const {
+        if (node == kNullIndex) return 0;
+
+        const Node &current = At(node);
+        if ((min && !compare_(*min, current.key_)) ||
+            (max && !compare_(current.key_, *max)) || current.Count() == 0) {
+            return -1;
+        }
+        int left = CheckSubtree(current.Left(), min, &current.key_);
+        int right = CheckSubtree(current.Right(), &current.key_, max);
+        if (left < 0 || right < 0 || std::abs(left - right) > 1 ||
+            current.Height() != 1 + std::max(left, right) ||
+            current.SubSize() != current.Count() +
+                                     GetSubSize(current.Left()) +
+                                     GetSubSize(current.Right())) {
+            return -1;
+        }
+        if constexpr (kAugmented && std::equality_comparable<Aggregate>) {
+            Aggregate expected = Augment::Combine(
+                Augment::Combine(GetAggregate(current.Left()),
+                                 Augment::Lift(current.key_, current.Count())),
+                GetAggregate(current.Right()));
+            if (!(current.Aggregate() == expected)) return -1;
+        }
+        return current.Height();
+    }
+
+   public:
+    AVLTree() = default;
+    explicit AVLTree(const Compare &compare) : compare_(compare) {}
+
+    ~AVLTree() { Clear(); }
+    // Iterative insert, O(log n). Returns whether the tree changed: false
+    // for a duplicate key outside multiset mode, in which case nothing is
+    // written.
+    bool Insert(KeyArg<T> key) { return InsertOccurrences(key, 1); }
+
+    // Removes one occurrence of key, O(log n). Returns false if the key is
+    // not in the tree.
+    bool Erase(KeyArg<T> key) {
+        NodeIndex path[kMaxHeight];
+        bool went_left[kMaxHeight];
+        int depth = 0;
+
+        NodeIndex node = root_;
+        while (node != kNullIndex) {
+            const Node &current = At(node);
+            assert(depth < kMaxHeight);
+            std::weak_ordering order = Order(key, current.key_);
+            if (order < 0) {
+                went_left[depth] = true;
+            } else if (order > 0) {
+                went_left[depth] = false;
+            } else {
+                break;
+            }
+            path[depth] = node;
+            node = went_left[depth] ? current.Left() : current.Right();
+            ++depth;
+        }
+        if (node == kNullIndex) return false;
+
+        ++version_;
+        Node &target = At(node);
+        if (target.Count() > 1) {
+            target.SetCount(target.Count() - 1);
+            path[depth] = node;
+            RefreshPath(path, depth + 1, -1);
+            return true;
+        }
+
+        // a node with two children takes over its in-order successor's key,
+        // the successor (which has no left child) is unlinked instead
+        NodeIndex replacement;
+        if (target.Left() != kNullIndex && target.Right() != kNullIndex) {
+            path[depth] = node;
+            went_left[depth++] = false;
+            NodeIndex successor = target.Right();
+            while (At(successor).Left() != kNullIndex) {
+                assert(depth < kMaxHeight);
+                path[depth] = successor;
+                went_left[depth++] = true;
+                successor = At(successor).Left();
+            }
+
+            target.key_ = std::move(At(successor).key_);
+            target.SetCount(At(successor).Count());
+            replacement = At(successor).Right();
+            arena_->Deallocate(successor);
+        } else {
+            replacement =
+                target.Left() != kNullIndex ? target.Left() : target.Right();
+            arena_->Deallocate(node);
+        }
+
+        NodeIndex subtree = replacement;
+        while (depth > 0) {
+            --depth;
+            Node &parent = At(path[depth]);
+            parent.SetChild(went_left[depth], subtree);
+            subtree = Balance(path[depth]);
+        }
+        root_ = subtree;
+        return true;
+    }
+
+    // Removes every occurrence of every key in [min, max] and returns how
+    // many were removed. The range is cut out with two splits and the
+    // remaining parts are joined back, O(log n) plus freeing the nodes.
+    size_t EraseRange(KeyArg<T> min, KeyArg<T> max) {
+        if (root_ == kNullIndex || compare_(max, min)) return 0;
+
+        auto [below, rest] = SplitAt<false>(root_, min);
+        auto [inside, above] = SplitAt<true>(rest, max);
+        size_t erased = GetSubSize(inside);
+        DestroySubtree(inside);
+        root_ = Join(below, above);
+        if (erased != 0) ++version_;
+        return erased;
+    }
+
+    // occurrences of key: 0 or 1, or the multiplicity in multiset mode
+    [[nodiscard]] size_t Count(KeyArg<T> key) const { return CountOf(key); }
+
+    template <typename K>
+        requires TransparentCompare<Compare>
+    [[nodiscard]] size_t Count(const K &key) const {
+        return CountOf(key);
+    }
+
+    // full structural check (ordering, heights, balance, sizes and
+    // comparable aggregates) in O(n), meant for tests and fuzzing
+    [[nodiscard]] bool IsValid() const {
+        return CheckSubtree(root_, nullptr, nullptr) >= 0;
+    }
+
+    enum class TraversalOrder { kPreOrder, kInOrder };
+
+    // Forward iterator over the keys in the given order. The pending nodes
+    // live in an inline array sized by the maximal AVL height, so iterators
+    // never allocate and the traversal order is fixed at compile time.
+    template <TraversalOrder kOrder>
     class AVLIterator final {
        private:
-        std::stack<const Node *> stack_;
-        std::unique_ptr<TraversalStrategy> strategy_;
-        bool isEnd_;
+        friend class AVLTree;
 
-       public:
-        AVLIterator(const Node *root,
-                    std::unique_ptr<TraversalStrategy> strategy)
-            : strategy_(std::move(strategy)), isEnd_(root == nullptr) {
-            if (!isEnd_) {
-                strategy_->Init(root, stack_);
+        const Pool *pool_ = nullptr;
+        NodeIndex stack_[kMaxHeight + 1];
+        int depth_ = 0;
+        size_t occurrence_ = 0;  // repeat of the current key, multiset only
+
+        const Node &NodeAt(NodeIndex node) const { return (*pool_)[node]; }
+
+        void Push(NodeIndex node) {
+            assert(depth_ <= kMaxHeight);
+            stack_[depth_++] = node;
+        }
+
+        void PushLeftmost(NodeIndex node) {
+            while (node != kNullIndex) {
+                Push(node);
+                node = NodeAt(node).Left();
             }
         }
 
+        AVLIterator(const Pool *pool, NodeIndex root) : pool_(pool) {
+            if (root == kNullIndex) return;
+            if constexpr (kOrder == TraversalOrder::kInOrder) {
+                PushLeftmost(root);
+            } else {
+                Push(root);
+            }
+        }
+
+       public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T *;
+        using reference = const T &;
+
+        AVLIterator() = default;
+
+        AVLIterator(const AVLIterator &other)
+            : pool_(other.pool_),
+              depth_(other.depth_),
+              occurrence_(other.occurrence_) {
+            std::copy(other.stack_, other.stack_ + depth_, stack_);
+        }
+
+        AVLIterator &operator=(const AVLIterator &other) {
+            pool_ = other.pool_;
+            depth_ = other.depth_;
+            occurrence_ = other.occurrence_;
+            std::copy(other.stack_, other.stack_ + depth_, stack_);
+            return *this;
+        }
+
         AVLIterator &operator++() {
-            if (!isEnd_) {
-                strategy_->Next(stack_);
-                if (strategy_->IsDone(stack_)) {
-                    isEnd_ = true;
+            assert(depth_ > 0);
+            if constexpr (kMultiset) {
+                if (++occurrence_ < NodeAt(stack_[depth_ - 1]).Count()) {
+                    return *this;
                 }
+                occurrence_ = 0;
+            }
+            const Node &current = NodeAt(stack_[--depth_]);
+            if constexpr (kOrder == TraversalOrder::kInOrder) {
+                PushLeftmost(current.Right());
+            } else {
+                if (current.Right() != kNullIndex) Push(current.Right());
+                if (current.Left() != kNullIndex) Push(current.Left());
             }
             return *this;
         }
 
-        const T &operator*() const { return strategy_->Current(stack_)->key_; }
-
-        bool operator!=(const AVLIterator &other) const {
-            return isEnd_ != other.isEnd_ || stack_ != other.stack_;
+        AVLIterator operator++(int) {
+            AVLIterator copy = *this;
+            ++*this;
+            return copy;
         }
 
+        reference operator*() const { return NodeAt(stack_[depth_ - 1]).key_; }
+
+        pointer operator->() const { return &**this; }
+
+        // a position is identified by the node on top of the stack
         bool operator==(const AVLIterator &other) const {
-            return isEnd_ == other.isEnd_ && stack_ == other.stack_;
+            return depth_ == other.depth_ && occurrence_ == other.occurrence_ &&
+                   (depth_ == 0 || stack_[depth_ - 1] ==
+                                       other.stack_[other.depth_ - 1]);
         }
     };  // class AVLIterator
 
-    // methods to create iterators for different traversal strategies
-    AVLIterator BeginPreOrder() const {
-        return AVLIterator(root_.get(), std::make_unique<PreOrderStrategy>());
+    using PreOrderIterator = AVLIterator<TraversalOrder::kPreOrder>;
+    using InOrderIterator = AVLIterator<TraversalOrder::kInOrder>;
+    using iterator = InOrderIterator;
+    using const_iterator = InOrderIterator;
+
+    // methods to create iterators for different traversal orders
+    PreOrderIterator BeginPreOrder() const {
+        return PreOrderIterator(arena_.get(), root_);
     }
 
-    AVLIterator EndPreOrder() const {
-        return AVLIterator(nullptr, std::make_unique<PreOrderStrategy>());
+    PreOrderIterator EndPreOrder() const {
+        return PreOrderIterator(arena_.get(), kNullIndex);
     }
 
-    AVLIterator BeginInOrder() const {
-        return AVLIterator(root_.get(), std::make_unique<InOrderStrategy>());
+    InOrderIterator BeginInOrder() const {
+        return InOrderIterator(arena_.get(), root_);
     }
 
-    AVLIterator EndInOrder() const {
-        return AVLIterator(nullptr, std::make_unique<InOrderStrategy>());
+    InOrderIterator EndInOrder() const {
+        return InOrderIterator(arena_.get(), kNullIndex);
     }
 
-    [[nodiscard]] size_t RangeQuery(const T &min, const T &max) const {
-        if (!root_ || min > max) {
-            // If tree is empty or min_key > max_key
-            return 0;
+    // in-order range, makes the tree usable with range-for and std::ranges
+    InOrderIterator begin() const { return BeginInOrder(); }
+    InOrderIterator end() const { return EndInOrder(); }
+
+    // first key not less than key, the stack is seeded in one descent
+    InOrderIterator LowerBound(KeyArg<T> key) const {
+        return SeekInOrder<false>(key);
+    }
+
+    template <typename K>
+        requires TransparentCompare<Compare>
+    InOrderIterator LowerBound(const K &key) const {
+        return SeekInOrder<false>(key);
+    }
+
+    // first key greater than key
+    InOrderIterator UpperBound(KeyArg<T> key) const {
+        return SeekInOrder<true>(key);
+    }
+
+    template <typename K>
+        requires TransparentCompare<Compare>
+    InOrderIterator UpperBound(const K &key) const {
+        return SeekInOrder<true>(key);
+    }
+
+    // calls callback(key) for every key in [min, max] in ascending order,
+    // O(log n + k)
+    template <typename Callback>
+    void ForEachInRange(KeyArg<T> min, KeyArg<T> max,
+                        Callback &&callback) const {
+        if (compare_(max, min)) return;
+
+        for (auto it = LowerBound(min), last = end();
+             it != last && !compare_(max, *it); ++it) {
+            callback(*it);
         }
+    }
+
+    // copies keys of [min, max] into out until it is full, returns how many
+    // were written
+    size_t CollectRange(KeyArg<T> min, KeyArg<T> max, std::span<T> out) const {
+        if (compare_(max, min)) return 0;
+
+        size_t written = 0;
+        for (auto it = LowerBound(min), last = end();
+             written < out.size() && it != last && !compare_(max, *it);
+             ++it) {
+            out[written++] = *it;
+        }
+        return written;
+    }
+
+    [[nodiscard]] size_t Size() const { return GetSubSize(root_); }
 
-        return RangeQueryInternal(root_.get(), min, max);
+    // number of keys strictly less than key, O(log n)
+    [[nodiscard]] size_t CountLess(KeyArg<T> key) const {
+        return CountBelow<false>(key);
     }
 
-    AVLTree(AVLTree &&) = default;
-    AVLTree &operator=(AVLTree &&) = default;
+    template <typename K>
+        requires TransparentCompare<Compare>
+    [[nodiscard]] size_t CountLess(const K &key) const {
+        return CountBelow<false>(key);
+    }
+
+    // number of keys less than or equal to key, O(log n)
+    [[nodiscard]] size_t CountLessEqual(KeyArg<T> key) const {
+        return CountBelow<true>(key);
+    }
+
+    template <typename K>
+        requires TransparentCompare<Compare>
+    [[nodiscard]] size_t CountLessEqual(const K &key) const {
+        return CountBelow<true>(key);
+    }
+
+    // zero-based in-order position of key (of its first occurrence), nullopt
+    // if key is not in the tree
+    [[nodiscard]] std::optional<size_t> Rank(KeyArg<T> key) const {
+        return RankOf(key);
+    }
+
+    template <typename K>
+        requires TransparentCompare<Compare>
+    [[nodiscard]] std::optional<size_t> Rank(const K &key) const {
+        return RankOf(key);
+    }
+
+    // k-th smallest key (zero-based), O(log n)
+    [[nodiscard]] const T &Select(size_t k) const {
+        if (k >= Size()) {
+            throw IndexOutOfRangeException();
+        }
+
+        NodeIndex node = root_;
+        while (true) {
+            const Node &current = At(node);
+            size_t left_size = GetSubSize(current.Left());
+            if (k < left_size) {
+                node = current.Left();
+            } else if (k >= left_size + current.Count()) {
+                k -= left_size + current.Count();
+                node = current.Right();
+            } else {
+                return current.key_;
+            }
+        }
+    }
+
+    // counted as a difference of two rank descents, O(log n)
+    [[nodiscard]] size_t RangeQuery(KeyArg<T> min, KeyArg<T> max) const {
+        return RangeCount<T>(min, max);
+    }
+
+    // bounds of any type Compare can order against T, e.g. std::string_view
+    // for std::string keys with std::less<>, nothing is converted to T
+    template <typename K>
+        requires TransparentCompare<Compare>
+    [[nodiscard]] size_t RangeQuery(const K &min, const K &max) const {
+        return RangeCount(min, max);
+    }
+
+    // Augment's fold over the keys in [min, max] in order, repeats
+    // included, O(log n); Augment::Identity() for an empty range
+    [[nodiscard]] Aggregate RangeAggregate(KeyArg<T> min, KeyArg<T> max) const
+        requires kAugmented
+    {
+        return AggregateRange<T>(min, max);
+    }
+
+    template <typename K>
+        requires kAugmented && TransparentCompare<Compare>
+    [[nodiscard]] Aggregate RangeAggregate(const K &min, const K &max) const {
+        return AggregateRange(min, max);
+    }
+
+    // CountLess of keys[i] into results[i]. On trees larger than the cache
+    // the descents run interleaved, kLockstepLanes at a time, which is
+    // several times faster than one CountLess after another.
+    void CountLessBatch(std::span<const T> keys,
+                        std::span<size_t> results) const {
+        assert(results.size() >= keys.size());
+        if (MemoryUsage() < kLockstepMinBytes) {
+            for (size_t i = 0; i < keys.size(); ++i) {
+                results[i] = CountLess(keys[i]);
+            }
+            return;
+        }
+
+        std::array<Descent<T>, kLockstepLanes> lanes;
+        for (size_t begin = 0; begin < keys.size(); begin += lanes.size()) {
+            size_t group = std::min(lanes.size(), keys.size() - begin);
+            for (size_t i = 0; i < group; ++i) {
+                lanes[i] = {.key = &keys[begin + i]};
+            }
+            DescendInLockstep(std::span(lanes).first(group));
+            for (size_t i = 0; i < group; ++i) {
+                results[begin + i] = lanes[i].count;
+            }
+        }
+    }
+
+    [[nodiscard]] std::vector<size_t> CountLessBatch(
+        std::span<const T> keys) const {
+        std::vector<size_t> results(keys.size());
+        CountLessBatch(keys, results);
+        return results;
+    }
+
+    // Answers queries[i] into results[i], with the two descents of each
+    // query interleaved with those of its neighbours as in CountLessBatch.
+    // The tree is only read, so with a pool the queries are also split
+    // between its threads; results keep the order of the queries either
+    // way.
+    void RangeQueryBatch(std::span<const std::pair<T, T>> queries,
+                         std::span<size_t> results,
+                         ThreadPool *pool = nullptr) const {
+        assert(results.size() >= queries.size());
+        auto run = [&](size_t begin, size_t end) {
+            if (MemoryUsage() < kLockstepMinBytes) {
+                for (size_t i = begin; i < end; ++i) {
+                    results[i] =
+                        RangeQuery(queries[i].first, queries[i].second);
+                }
+                return;
+            }
+
+            stats_.Record(TreeEvent::kRangeQuery, end - begin);
+            // lane 2i counts the keys below min of a query, lane 2i + 1
+            // those not above its max
+            std::array<Descent<T>, kLockstepLanes> lanes;
+            constexpr size_t kQueriesPerGroup = kLockstepLanes / 2;
+            for (; begin < end; begin += kQueriesPerGroup) {
+                size_t group = std::min(kQueriesPerGroup, end - begin);
+                for (size_t i = 0; i < group; ++i) {
+                    const auto &[min, max] = queries[begin + i];
+                    lanes[2 * i] = {.key = &min};
+                    lanes[2 * i + 1] = {.key = &max, .inclusive = true};
+                }
+                DescendInLockstep(std::span(lanes).first(2 * group));
+                for (size_t i = 0; i < group; ++i) {
+                    const auto &[min, max] = queries[begin + i];
+                    results[begin + i] =
+                        compare_(max, min)
+                            ? 0
+                            : lanes[2 * i + 1].count - lanes[2 * i].count;
+                }
+            }
+        };
+
+        if (pool) {
+            pool->ParallelFor(queries.size(), kMinQueriesPerTask, run);
+        } else {
+            run(0, queries.size());
+        }
+    }
+
+    [[nodiscard]] std::vector<size_t> RangeQueryBatch(
+        std::span<const std::pair<T, T>> queries,
+        ThreadPool *pool = nullptr) const {
+        std::vector<size_t> results(queries.size());
+        RangeQueryBatch(queries, results, pool);
+        return results;
+    }
+
+    // Builds a balanced tree from an arbitrary range in O(n) once the keys
+    // are sorted (sorting is skipped for already sorted input)
+    template <typename InputIt>
+    static AVLTree FromRange(InputIt first, InputIt last) {
+        AVLTree tree;
+        std::vector<T> keys(first, last);
+        std::vector<size_t> counts = tree.SortAndGroup(keys);
+        tree.root_ = tree.BuildBalanced(keys, counts, 0, keys.size());
+        return tree;
+    }
+
+    // Adds a batch of keys. Small batches go through Insert, larger ones are
+    // merged with the existing keys and the tree is rebuilt in O(n + m).
+    template <typename InputIt>
+    void BulkLoad(InputIt first, InputIt last) {
+        std::vector<T> batch(first, last);
+        std::vector<size_t> batch_counts = SortAndGroup(batch);
+        if (batch.empty()) return;
+        uint64_t version = version_;
+
+        size_t size = Size();
+        size_t depth = 1;
+        for (size_t rest = size; rest > 1; rest >>= 1) {
+            ++depth;
+        }
+        if (batch.size() * depth < size) {
+            for (size_t i = 0; i < batch.size(); ++i) {
+                InsertOccurrences(batch[i], kMultiset ? batch_counts[i] : 1);
+            }
+            return;
+        }
+
+        std::vector<T> existing;
+        std::vector<size_t> existing_counts;
+        existing.reserve(size);
+        MoveOutInOrder(existing, existing_counts);
+        Clear();
+
+        // merge the two sorted runs, equal keys are kept once
+        std::vector<T> merged;
+        std::vector<size_t> merged_counts;
+        merged.reserve(existing.size() + batch.size());
+        size_t i = 0;
+        size_t j = 0;
+        while (i < existing.size() || j < batch.size()) {
+            bool take_existing =
+                j == batch.size() ||
+                (i < existing.size() && !compare_(batch[j], existing[i]));
+            bool take_batch =
+                i == existing.size() ||
+                (j < batch.size() && !compare_(existing[i], batch[j]));
+
+            size_t count = 0;
+            if (take_existing) {
+                if constexpr (kMultiset) count += existing_counts[i];
+                merged.push_back(std::move(existing[i++]));
+                if (take_batch) ++j;
+            } else {
+                merged.push_back(std::move(batch[j++]));
+            }
+            if constexpr (kMultiset) {
+                if (take_batch) count += batch_counts[j - 1];
+                merged_counts.push_back(count);
+            }
+        }
+        root_ = BuildBalanced(merged, merged_counts, 0, merged.size());
+        // a batch of keys already present leaves the tree as it was
+        if (Size() != size) version_ = version + 1;
+    }
+
+    // Read-only copy of the keys in a cache-line-blocked layout, for phases
+    // that only run queries. The index orders keys with operator<.
+    [[nodiscard]] FrozenRangeIndex<T> Freeze() const
+        requires kNaturalOrder
+    {
+        std::vector<T> keys;
+        keys.reserve(Size());
+        for (const T &key : *this) {
+            keys.push_back(key);
+        }
+        return FrozenRangeIndex<T>(keys);
+    }
+
+    // Splits the tree into keys below key and the rest in O(log n). Both
+    // results keep using this tree's node pool, this tree is left empty.
+    // Trees sharing a pool must not be modified concurrently.
+    [[nodiscard]] std::pair<AVLTree, AVLTree> Split(KeyArg<T> key) {
+        std::pair<AVLTree, AVLTree> parts{AVLTree(compare_),
+                                          AVLTree(compare_)};
+        if (root_ == kNullIndex) return parts;
+
+        auto [below, rest] = SplitAt<false>(root_, key);
+        parts.first.arena_ = arena_;
+        parts.first.root_ = below;
+        parts.second.arena_ = std::move(arena_);
+        parts.second.root_ = rest;
+        root_ = kNullIndex;
+        ++version_;
+        return parts;
+    }
+
+    // Concatenates two trees whose key ranges do not overlap (every key of
+    // left below every key of right), O(log n) when they share a node pool.
+    // Otherwise the smaller tree is first rebuilt inside the larger one's
+    // pool, O(log n + min(n, m)).
+    [[nodiscard]] static AVLTree Join(AVLTree &&left, AVLTree &&right) {
+        if (left.root_ == kNullIndex) return std::move(right);
+        if (right.root_ == kNullIndex) return std::move(left);
+        if (!left.compare_(left.MaxKey(), right.MinKey())) {
+            throw UnorderedJoinException();
+        }
+
+        if (left.arena_ != right.arena_) {
+            bool left_is_larger = left.Size() >= right.Size();
+            AVLTree &larger = left_is_larger ? left : right;
+            AVLTree &smaller = left_is_larger ? right : left;
+
+            std::vector<T> keys;
+            std::vector<size_t> counts;
+            smaller.MoveOutInOrder(keys, counts);
+            smaller.Clear();
+            smaller.arena_ = larger.arena_;
+            smaller.root_ = smaller.BuildBalanced(keys, counts, 0, keys.size());
+        }
+
+        AVLTree joined(left.compare_);
+        joined.arena_ = std::move(left.arena_);
+        joined.root_ = joined.Join(std::exchange(left.root_, kNullIndex),
+                                   std::exchange(right.root_, kNullIndex));
+        right.arena_.reset();
+        return joined;
+    }
+
+    // Writes the keys to path in the snapshot format of snapshot.hpp,
+    // replacing the file atomically. Needs trivially copyable keys. sequence
+    // is kept in the header for the caller, see MappedSnapshot::Sequence.
+    // MappedSnapshot searches the keys with operator<, so a tree ordered by
+    // another Compare cannot be saved.
+    void SaveSnapshot(const std::string &path, uint64_t sequence = 0) const
+        requires kNaturalOrder
+    {
+        std::vector<T> keys;
+        std::vector<uint64_t> cumulative;
+        uint64_t total = 0;
+        ForEachNodeInOrder([&](NodeIndex node) {
+            keys.push_back(At(node).key_);
+            if constexpr (kMultiset) {
+                total += At(node).Count();
+                cumulative.push_back(total);
+            }
+        });
+        snapshot::Write<T>(path, keys, cumulative, kMultiset, sequence);
+    }
+
+    // Rebuilds a balanced tree from a file written by SaveSnapshot in O(n),
+    // throws SnapshotFormatException if the file does not check out. Use
+    // MappedSnapshot to query a snapshot without loading it.
+    static AVLTree LoadSnapshot(const std::string &path)
+        requires kNaturalOrder
+    {
+        return FromSnapshot(MappedSnapshot<T>(path));
+    }
+
+    static AVLTree FromSnapshot(const MappedSnapshot<T> &mapped)
+        requires kNaturalOrder
+    {
+        std::vector<T> keys(mapped.Keys().begin(), mapped.Keys().end());
+        std::vector<size_t> counts;
+        if constexpr (kMultiset) {
+            auto cumulative = mapped.CumulativeCounts();
+            counts.assign(keys.size(), 1);
+            for (size_t i = 0; i < cumulative.size(); ++i) {
+                counts[i] = cumulative[i] - (i > 0 ? cumulative[i - 1] : 0);
+            }
+        }
+
+        AVLTree tree;
+        tree.root_ = tree.BuildBalanced(keys, counts, 0, keys.size());
+        return tree;
+    }
+
+    // Changes made to this tree so far. Every Insert that adds a key (or an
+    // occurrence, in multiset mode) adds exactly one, duplicates rejected in
+    // set mode add none; Erase, EraseRange, BulkLoad, Split and being moved
+    // from or into also count. Equal versions of one tree mean equal keys,
+    // which lets callers cache answers, see CachedAVLTree.
+    [[nodiscard]] uint64_t Version() const { return version_; }
+
+    // node memory held by the arena, in bytes (the whole pool if shared)
+    [[nodiscard]] size_t MemoryUsage() const {
+        return arena_ ? arena_->MemoryUsage() : 0;
+    }
+
+    // Event counts (with AVL_TREE_STATS) and shape of the tree, for
+    // telling slow inputs apart by what they do to it
+    [[nodiscard]] TreeCounters Counters() const {
+        return {
+            .left_rotations = stats_.Get(TreeEvent::kLeftRotation),
+            .right_rotations = stats_.Get(TreeEvent::kRightRotation),
+            .comparisons = stats_.Get(TreeEvent::kComparison),
+            .range_queries = stats_.Get(TreeEvent::kRangeQuery),
+            .nodes_visited = stats_.Get(TreeEvent::kNodeVisit),
+            .duplicate_inserts = stats_.Get(TreeEvent::kDuplicateInsert),
+            .max_height = std::max(stats_.MaxHeight(), GetHeight(root_)),
+            .node_bytes = MemoryUsage(),
+        };
+    }
+
+    void ResetCounters() { stats_.Reset(); }
+
+    AVLTree(AVLTree &&other) noexcept
+        : arena_(std::move(other.arena_)),
+          root_(std::exchange(other.root_, kNullIndex)),
+          version_(other.version_++),
+          compare_(other.compare_),
+          stats_(other.stats_) {}
+
+    AVLTree &operator=(AVLTree &&other) noexcept {
+        if (this != &other) {
+            Clear();
+            arena_ = std::move(other.arena_);
+            root_ = std::exchange(other.root_, kNullIndex);
+            version_ = std::max(version_, other.version_++) + 1;
+            compare_ = other.compare_;
+            stats_ = other.stats_;
+        }
+        return *this;
+    }
 
     AVLTree(const AVLTree &) = delete;
     AVLTree &operator=(const AVLTree &) = delete;
 };  // class AVLTree
 
+template <typename T, typename Compare = std::less<T>,
+          typename NodeStorage = ArenaStorage<>>
+using AVLMultiset = AVLTree<T, Compare, NodeStorage, true>;
+
+// AVLTree answering RangeAggregate with Augment, e.g.
+// AugmentedAVLTree<int64_t, SumAugmentation<int64_t>> for range sums
+template <typename T, AugmentationFor<T> Augment,
+          typename Compare = std::less<T>, bool kMultiset = false>
+using AugmentedAVLTree =
+    AVLTree<T, Compare, ArenaStorage<>, kMultiset, Augment>;
+
 }  // namespace avl_tree
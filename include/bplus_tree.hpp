@@ -0,0 +1,372 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+#include "tree_exceptions.hpp"
+
+namespace avl_tree {
+
+// B+-tree of distinct keys with nodes of kNodeBytes, a multiple of the cache
+// line. Leaves hold sorted keys and link to their right sibling for
+// iteration; inner nodes hold separators, child links and the number of keys
+// below each child, so counting queries add up one row of counts per level
+// instead of chasing one pointer per key bit as a binary tree does. Nodes
+// live in two vectors and link by 32-bit index. There is no erase.
+template <typename T, size_t kNodeBytes = 256>
+class BPlusTree final {
+   private:
+    static_assert(kNodeBytes % 64 == 0, "nodes are whole cache lines");
+    static_assert(std::is_default_constructible_v<T>,
+                  "nodes keep keys in fixed arrays");
+
+    using Index = uint32_t;
+    static constexpr Index kNoNode = std::numeric_limits<Index>::max();
+
+    static constexpr size_t kLeafCapacity =
+        (kNodeBytes - 2 * sizeof(uint32_t)) / sizeof(T);
+    // children per inner node, each costs a separator, a link and a count
+    static constexpr size_t kFanout =
+        (kNodeBytes - sizeof(uint32_t) + sizeof(T)) /
+        (sizeof(T) + 2 * sizeof(uint32_t));
+    static_assert(kLeafCapacity >= 4 && kFanout >= 4,
+                  "kNodeBytes is too small for this key type");
+
+    struct alignas(64) Leaf final {
+        T keys[kLeafCapacity];
+        uint32_t count = 0;
+        Index next = kNoNode;
+    };
+
+    // child i holds the keys in [keys[i - 1], keys[i])
+    struct alignas(64) Inner final {
+        T keys[kFanout - 1];
+        Index children[kFanout];
+        uint32_t sizes[kFanout];
+        uint32_t count = 0;  // children
+    };
+
+    // what a child reports after an insert that split it
+    struct Split final {
+        T separator;  // smallest key of right
+        Index right;
+    };
+
+    std::vector<Leaf> leaves_;
+    std::vector<Inner> inners_;
+    Index root_ = kNoNode;
+    int height_ = 0;  // inner levels above the leaves
+    size_t size_ = 0;
+
+    Index NewLeaf() {
+        if (leaves_.size() == kNoNode) throw CapacityExceededException();
+        leaves_.emplace_back();
+        return static_cast<Index>(leaves_.size() - 1);
+    }
+
+    Index NewInner() {
+        if (inners_.size() == kNoNode) throw CapacityExceededException();
+        inners_.emplace_back();
+        return static_cast<Index>(inners_.size() - 1);
+    }
+
+    size_t SubtreeSize(Index node, int level) const {
+        if (level == 0) return leaves_[node].count;
+        const Inner &inner = inners_[node];
+        size_t size = 0;
+        for (uint32_t i = 0; i < inner.count; ++i) {
+            size += inner.sizes[i];
+        }
+        return size;
+    }
+
+    // child of inner to descend into for key
+    static uint32_t ChildFor(const Inner &inner, const T &key) {
+        return static_cast<uint32_t>(
+            std::upper_bound(inner.keys, inner.keys + inner.count - 1, key) -
+            inner.keys);
+    }
+
+    std::optional<Split> InsertIntoLeaf(Index node, const T &key,
+                                        bool &inserted) {
+        Leaf *leaf = &leaves_[node];
+        uint32_t pos = static_cast<uint32_t>(
+            std::lower_bound(leaf->keys, leaf->keys + leaf->count, key) -
+            leaf->keys);
+        if (pos < leaf->count && !(key < leaf->keys[pos])) return std::nullopt;
+        inserted = true;
+
+        if (leaf->count < kLeafCapacity) {
+            std::move_backward(leaf->keys + pos, leaf->keys + leaf->count,
+                               leaf->keys + leaf->count + 1);
+            leaf->keys[pos] = key;
+            ++leaf->count;
+            return std::nullopt;
+        }
+
+        // the upper half moves to a new right sibling
+        Index right = NewLeaf();
+        leaf = &leaves_[node];
+        Leaf &sibling = leaves_[right];
+        uint32_t half = static_cast<uint32_t>(kLeafCapacity / 2);
+        std::move(leaf->keys + half, leaf->keys + leaf->count, sibling.keys);
+        sibling.count = leaf->count - half;
+        leaf->count = half;
+        sibling.next = leaf->next;
+        leaf->next = right;
+
+        Leaf &target = pos <= half ? *leaf : sibling;
+        uint32_t at = pos <= half ? pos : pos - half;
+        std::move_backward(target.keys + at, target.keys + target.count,
+                           target.keys + target.count + 1);
+        target.keys[at] = key;
+        ++target.count;
+        return Split{sibling.keys[0], right};
+    }
+
+    std::optional<Split> InsertInto(Index node, int level, const T &key,
+                                    bool &inserted) {
+        if (level == 0) return InsertIntoLeaf(node, key, inserted);
+
+        uint32_t child = ChildFor(inners_[node], key);
+        std::optional<Split> split =
+            InsertInto(inners_[node].children[child], level - 1, key, inserted);
+        if (!inserted) return std::nullopt;
+
+        Inner *inner = &inners_[node];
+        if (!split) {
+            ++inner->sizes[child];
+            return std::nullopt;
+        }
+
+        // the child became two, rebuild this node's rows with both halves
+        T keys[kFanout];
+        Index children[kFanout + 1];
+        uint32_t sizes[kFanout + 1];
+        uint32_t count = inner->count + 1;
+        std::copy(inner->keys, inner->keys + child, keys);
+        keys[child] = split->separator;
+        std::copy(inner->keys + child, inner->keys + inner->count - 1,
+                  keys + child + 1);
+        std::copy(inner->children, inner->children + child + 1, children);
+        children[child + 1] = split->right;
+        std::copy(inner->children + child + 1,
+                  inner->children + inner->count, children + child + 2);
+        std::copy(inner->sizes, inner->sizes + child, sizes);
+        sizes[child] = static_cast<uint32_t>(
+            SubtreeSize(inner->children[child], level - 1));
+        sizes[child + 1] =
+            static_cast<uint32_t>(SubtreeSize(split->right, level - 1));
+        std::copy(inner->sizes + child + 1, inner->sizes + inner->count,
+                  sizes + child + 2);
+
+        if (count <= kFanout) {
+            std::copy(keys, keys + count - 1, inner->keys);
+            std::copy(children, children + count, inner->children);
+            std::copy(sizes, sizes + count, inner->sizes);
+            inner->count = count;
+            return std::nullopt;
+        }
+
+        // the separator between the halves moves up
+        Index right = NewInner();
+        inner = &inners_[node];
+        Inner &sibling = inners_[right];
+        uint32_t half = count / 2;
+        std::copy(keys, keys + half - 1, inner->keys);
+        std::copy(children, children + half, inner->children);
+        std::copy(sizes, sizes + half, inner->sizes);
+        inner->count = half;
+        std::copy(keys + half, keys + count - 1, sibling.keys);
+        std::copy(children + half, children + count, sibling.children);
+        std::copy(sizes + half, sizes + count, sibling.sizes);
+        sibling.count = count - half;
+        return Split{keys[half - 1], right};
+    }
+
+    // number of keys below key (kInclusive: below or equal), one descent
+    template <bool kInclusive>
+    size_t CountBelow(const T &key) const {
+        if (root_ == kNoNode) return 0;
+
+        size_t count = 0;
+        Index node = root_;
+        for (int level = height_; level > 0; --level) {
+            const Inner &inner = inners_[node];
+            uint32_t child = ChildFor(inner, key);
+            for (uint32_t i = 0; i < child; ++i) {
+                count += inner.sizes[i];
+            }
+            node = inner.children[child];
+        }
+
+        const Leaf &leaf = leaves_[node];
+        for (uint32_t i = 0; i < leaf.count; ++i) {
+            count += kInclusive ? !(key < leaf.keys[i]) : leaf.keys[i] < key;
+        }
+        return count;
+    }
+
+    // checks order, separators, counts and depth below node, returns the
+    // number of keys or nullopt when something is off
+    std::optional<size_t> CheckSubtree(Index node, int level, const T *min,
+                                       const T *max) const {
+        if (level == 0) {
+            const Leaf &leaf = leaves_[node];
+            if (leaf.count == 0 && size_ != 0) return std::nullopt;
+            for (uint32_t i = 0; i < leaf.count; ++i) {
+                if ((i > 0 && !(leaf.keys[i - 1] < leaf.keys[i])) ||
+                    (min && leaf.keys[i] < *min) ||
+                    (max && !(leaf.keys[i] < *max))) {
+                    return std::nullopt;
+                }
+            }
+            return leaf.count;
+        }
+
+        const Inner &inner = inners_[node];
+        if (inner.count < 2) return std::nullopt;
+        size_t total = 0;
+        for (uint32_t i = 0; i < inner.count; ++i) {
+            const T *low = i > 0 ? &inner.keys[i - 1] : min;
+            const T *high = i + 1 < inner.count ? &inner.keys[i] : max;
+            std::optional<size_t> size =
+                CheckSubtree(inner.children[i], level - 1, low, high);
+            if (!size || *size != inner.sizes[i]) return std::nullopt;
+            total += *size;
+        }
+        return total;
+    }
+
+   public:
+    // Forward iterator walking the leaf chain
+    class ConstIterator final {
+       private:
+        friend class BPlusTree;
+
+        const BPlusTree *tree_ = nullptr;
+        Index leaf_ = kNoNode;
+        uint32_t pos_ = 0;
+
+        ConstIterator(const BPlusTree *tree, Index leaf)
+            : tree_(tree), leaf_(leaf) {
+            SkipEmpty();
+        }
+
+        void SkipEmpty() {
+            while (leaf_ != kNoNode && pos_ == tree_->leaves_[leaf_].count) {
+                leaf_ = tree_->leaves_[leaf_].next;
+                pos_ = 0;
+            }
+        }
+
+       public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T *;
+        using reference = const T &;
+
+        ConstIterator() = default;
+
+        reference operator*() const {
+            return tree_->leaves_[leaf_].keys[pos_];
+        }
+        pointer operator->() const { return &**this; }
+
+        ConstIterator &operator++() {
+            ++pos_;
+            SkipEmpty();
+            return *this;
+        }
+
+        ConstIterator operator++(int) {
+            ConstIterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool operator==(const ConstIterator &other) const {
+            return leaf_ == other.leaf_ && pos_ == other.pos_;
+        }
+    };
+
+    BPlusTree() = default;
+
+    // returns whether the tree changed, duplicates are not stored
+    bool Insert(const T &key) {
+        if (size_ == std::numeric_limits<uint32_t>::max()) {
+            throw CapacityExceededException();
+        }
+        if (root_ == kNoNode) root_ = NewLeaf();
+
+        bool inserted = false;
+        std::optional<Split> split = InsertInto(root_, height_, key, inserted);
+        if (!inserted) return false;
+        ++size_;
+
+        if (split) {
+            Index root = NewInner();
+            Inner &inner = inners_[root];
+            inner.keys[0] = split->separator;
+            inner.children[0] = root_;
+            inner.children[1] = split->right;
+            inner.sizes[0] =
+                static_cast<uint32_t>(SubtreeSize(root_, height_));
+            inner.sizes[1] =
+                static_cast<uint32_t>(SubtreeSize(split->right, height_));
+            inner.count = 2;
+            root_ = root;
+            ++height_;
+        }
+        return true;
+    }
+
+    [[nodiscard]] size_t CountLess(const T &key) const {
+        return CountBelow<false>(key);
+    }
+
+    [[nodiscard]] size_t CountLessEqual(const T &key) const {
+        return CountBelow<true>(key);
+    }
+
+    // counted as a difference of two descents, O(log n)
+    [[nodiscard]] size_t RangeQuery(const T &min, const T &max) const {
+        if (size_ == 0 || max < min) {
+            return 0;
+        }
+
+        return CountLessEqual(max) - CountLess(min);
+    }
+
+    [[nodiscard]] size_t Size() const { return size_; }
+
+    // the first leaf is never split off, it stays leftmost
+    ConstIterator begin() const {
+        return ConstIterator(this, leaves_.empty() ? kNoNode : 0);
+    }
+    ConstIterator end() const { return ConstIterator(this, kNoNode); }
+
+    // node memory in bytes
+    [[nodiscard]] size_t MemoryUsage() const {
+        return leaves_.capacity() * sizeof(Leaf) +
+               inners_.capacity() * sizeof(Inner);
+    }
+
+    // full structural check (order, separators, counts, uniform depth) in
+    // O(n), meant for tests and fuzzing
+    [[nodiscard]] bool IsValid() const {
+        if (root_ == kNoNode) return size_ == 0;
+        std::optional<size_t> size =
+            CheckSubtree(root_, height_, nullptr, nullptr);
+        return size && *size == size_;
+    }
+};
+
+}  // namespace avl_tree
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "avl_tree.hpp"
+#include "thread_pool.hpp"
+
+namespace avl_tree {
+
+// what a CachedAVLTree reports about its cache
+struct CacheCounters final {
+    uint64_t hits = 0;     // answered from an entry, patched ones included
+    uint64_t patched = 0;  // hits first brought up to date from the log
+    uint64_t misses = 0;   // answered by a descent, then cached
+    uint64_t evictions = 0;
+    size_t entries = 0;
+};
+
+// AVLTree answering repeated RangeQuery windows from a bounded cache of
+// (min, max) -> count entries, each tagged with the tree Version it was
+// counted at. The keys added by the last kLogSize inserts are kept, so an
+// entry counted before them is brought up to date by checking those keys
+// against its window: a new key only changes the entries it falls inside,
+// every other window stays a hit. Entries older than the log are counted
+// again. A full cache evicts with CLOCK. Queries write to the cache, so
+// unlike AVLTree a CachedAVLTree must not be queried from several threads
+// at once.
+template <typename T, typename NodeStorage = ArenaStorage<>,
+          bool kMultiset = false>
+class CachedAVLTree final {
+   private:
+    using Tree = AVLTree<T, std::less<T>, NodeStorage, kMultiset>;
+
+    static constexpr size_t kDefaultCapacity = 4096;
+    // checking this many keys against a window is still cheaper than a
+    // descent through a tree that does not fit the cache
+    static constexpr uint64_t kLogSize = 64;
+
+    struct Entry final {
+        T min{};
+        T max{};
+        size_t count = 0;
+        uint64_t version = 0;
+        bool referenced = false;  // hit since the clock hand last passed
+    };
+
+    struct BoundsHash final {
+        size_t operator()(const std::pair<T, T> &bounds) const {
+            size_t first = std::hash<T>()(bounds.first);
+            return first * 0x9e3779b97f4a7c15 ^ std::hash<T>()(bounds.second);
+        }
+    };
+
+    Tree tree_;
+    size_t capacity_;
+    std::vector<T> log_;  // the key Insert added at version v, at v % kLogSize
+
+    mutable std::vector<Entry> entries_;
+    mutable std::unordered_map<std::pair<T, T>, size_t, BoundsHash> slots_;
+    mutable size_t hand_ = 0;
+    mutable CacheCounters counters_;
+
+    static bool Inside(const T &key, const T &min, const T &max) {
+        return !(key < min) && !(max < key);
+    }
+
+    // a free slot, or the first one the clock hand finds not referenced
+    size_t ClaimSlot() const {
+        if (entries_.size() < capacity_) {
+            entries_.emplace_back();
+            return entries_.size() - 1;
+        }
+
+        while (entries_[hand_].referenced) {
+            entries_[hand_].referenced = false;
+            hand_ = (hand_ + 1) % capacity_;
+        }
+        size_t slot = hand_;
+        hand_ = (hand_ + 1) % capacity_;
+        slots_.erase({entries_[slot].min, entries_[slot].max});
+        ++counters_.evictions;
+        return slot;
+    }
+
+   public:
+    explicit CachedAVLTree(size_t capacity = kDefaultCapacity)
+        : capacity_(capacity), log_(kLogSize) {
+        entries_.reserve(capacity_);
+        slots_.reserve(capacity_);
+    }
+
+    // entries are tied to this tree's versions and log
+    CachedAVLTree(const CachedAVLTree &) = delete;
+    CachedAVLTree &operator=(const CachedAVLTree &) = delete;
+
+    // returns whether the tree changed, see AVLTree::Insert
+    bool Insert(const T &key) {
+        if (!tree_.Insert(key)) return false;
+        log_[tree_.Version() % kLogSize] = key;
+        return true;
+    }
+
+    // AVLTree::RangeQuery, O(1) for a window asked before unless more than
+    // kLogSize keys were added since or it was evicted
+    [[nodiscard]] size_t RangeQuery(const T &min, const T &max) const {
+        if (capacity_ == 0) return tree_.RangeQuery(min, max);
+        if (max < min) return 0;
+
+        uint64_t version = tree_.Version();
+        auto it = slots_.find({min, max});
+        if (it != slots_.end()) {
+            Entry &entry = entries_[it->second];
+            if (version - entry.version <= kLogSize) {
+                if (entry.version != version) {
+                    for (uint64_t v = entry.version + 1; v <= version; ++v) {
+                        if (Inside(log_[v % kLogSize], min, max)) {
+                            ++entry.count;
+                        }
+                    }
+                    entry.version = version;
+                    ++counters_.patched;
+                }
+                entry.referenced = true;
+                ++counters_.hits;
+                return entry.count;
+            }
+
+            ++counters_.misses;
+            entry.count = tree_.RangeQuery(min, max);
+            entry.version = version;
+            entry.referenced = true;
+            return entry.count;
+        }
+
+        ++counters_.misses;
+        size_t count = tree_.RangeQuery(min, max);
+        // a new window survives the next sweep of the hand only if it is
+        // asked again, so one-off windows do not push out the hot ones
+        size_t slot = ClaimSlot();
+        entries_[slot] = {.min = min,
+                          .max = max,
+                          .count = count,
+                          .version = version};
+        slots_.emplace(std::pair<T, T>(min, max), slot);
+        return count;
+    }
+
+    // Answers queries[i] into results[i] through the cache, on the calling
+    // thread: the pool is not used since the cache is not thread-safe.
+    void RangeQueryBatch(std::span<const std::pair<T, T>> queries,
+                         std::span<size_t> results,
+                         ThreadPool * /*pool*/ = nullptr) const {
+        assert(results.size() >= queries.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            results[i] = RangeQuery(queries[i].first, queries[i].second);
+        }
+    }
+
+    [[nodiscard]] CacheCounters CacheStats() const {
+        CacheCounters counters = counters_;
+        counters.entries = slots_.size();
+        return counters;
+    }
+
+    [[nodiscard]] TreeCounters Counters() const { return tree_.Counters(); }
+
+    [[nodiscard]] const Tree &View() const { return tree_; }
+
+    [[nodiscard]] size_t Size() const { return tree_.Size(); }
+
+    typename Tree::InOrderIterator begin() const { return tree_.begin(); }
+    typename Tree::InOrderIterator end() const { return tree_.end(); }
+};
+
+}  // namespace avl_tree
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "avl_tree.hpp"
+#include "snapshot.hpp"
+#include "write_ahead_log.hpp"
+
+namespace avl_tree {
+
+// AVLTree whose inserts survive a crash. Every key goes to a write-ahead
+// log (path + ".wal") before it is inserted; Checkpoint writes a snapshot
+// (path + ".snapshot") and starts the log over. Opening recovers the
+// snapshot, then bulk-inserts the log records it does not include yet.
+template <typename T, typename NodeStorage = ArenaStorage<>,
+          bool kMultiset = false>
+class DurableAVLTree final {
+   private:
+    using Tree = AVLTree<T, std::less<T>, NodeStorage, kMultiset>;
+
+    std::string snapshot_path_;
+    std::string log_path_;
+    DurabilityOptions options_;
+    Tree tree_;
+    std::optional<WriteAheadLog<T>> log_;
+
+   public:
+    explicit DurableAVLTree(const std::string &path,
+                            DurabilityOptions options = {})
+        : snapshot_path_(path + ".snapshot"),
+          log_path_(path + ".wal"),
+          options_(options) {
+        // records numbered below applied are in the snapshot already
+        uint64_t applied = 0;
+        if (access(snapshot_path_.c_str(), F_OK) == 0) {
+            MappedSnapshot<T> mapped(snapshot_path_);
+            applied = mapped.Sequence();
+            tree_ = Tree::FromSnapshot(mapped);
+        }
+
+        std::vector<T> replay;
+        log_.emplace(log_path_, options_, &replay);
+        uint64_t first = log_->BaseSequence();
+        size_t skip = static_cast<size_t>(
+            std::min<uint64_t>(applied > first ? applied - first : 0,
+                               replay.size()));
+        tree_.BulkLoad(replay.begin() + static_cast<std::ptrdiff_t>(skip),
+                       replay.end());
+
+        // a crash right after a checkpoint leaves the old log behind, new
+        // records must not reuse the numbers the snapshot covers
+        if (applied > log_->NextSequence()) {
+            log_.reset();
+            WriteAheadLog<T>::Reset(log_path_, applied);
+            log_.emplace(log_path_, options_);
+        }
+    }
+
+    DurableAVLTree(const DurableAVLTree &) = delete;
+    DurableAVLTree &operator=(const DurableAVLTree &) = delete;
+
+    // returns whether the tree changed, keys already present in a set are
+    // not logged
+    bool Insert(const T &key) {
+        if constexpr (!kMultiset) {
+            if (tree_.Count(key) != 0) return false;
+        }
+        log_->Append(key);
+        return tree_.Insert(key);
+    }
+
+    template <typename InputIt>
+    void BulkLoad(InputIt first, InputIt last) {
+        std::vector<T> keys(first, last);
+        for (const T &key : keys) {
+            log_->Append(key);
+        }
+        tree_.BulkLoad(keys.begin(), keys.end());
+    }
+
+    // makes every insert so far durable regardless of the group settings
+    void Sync() { log_->Commit(); }
+
+    // snapshots the tree and empties the log, bounding recovery time
+    void Checkpoint() {
+        log_->Commit();
+        uint64_t sequence = log_->NextSequence();
+        // the snapshot's rename is on disk before the log starts over, a
+        // crash in between finds the new snapshot ahead of the old log
+        tree_.SaveSnapshot(snapshot_path_, sequence);
+        log_.reset();
+        WriteAheadLog<T>::Reset(log_path_, sequence);
+        log_.emplace(log_path_, options_);
+    }
+
+    [[nodiscard]] const Tree &View() const { return tree_; }
+
+    [[nodiscard]] size_t Size() const { return tree_.Size(); }
+
+    [[nodiscard]] size_t RangeQuery(const T &min, const T &max) const {
+        return tree_.RangeQuery(min, max);
+    }
+};
+
+template <typename T, typename NodeStorage = ArenaStorage<>>
+using DurableAVLMultiset = DurableAVLTree<T, NodeStorage, true>;
+
+}  // namespace avl_tree
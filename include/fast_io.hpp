@@ -0,0 +1,225 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+namespace range_queries {
+
+struct Command final {
+    char type;
+    int first = 0;
+    int second = 0;
+};
+
+// Reads range_queries commands straight from a file descriptor. Regular
+// files are mmap-ed and parsed in place, pipes and terminals are read in
+// large chunks. Integers are parsed with std::from_chars. Malformed input is
+// reported with the same std::invalid_argument messages the stream-based
+// reader used.
+class CommandReader final {
+   private:
+    static constexpr size_t kChunkSize = size_t{1} << 20;
+
+    int fd_;
+    const char *pos_ = nullptr;
+    const char *end_ = nullptr;
+    void *mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    std::vector<char> buffer_;
+    bool eof_ = false;
+
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' ||
+               c == '\f';
+    }
+
+    static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+    bool TryMap() {
+        struct stat info;
+        if (fstat(fd_, &info) != 0 || !S_ISREG(info.st_mode) ||
+            info.st_size == 0) {
+            return false;
+        }
+
+        void *mapping = mmap(nullptr, static_cast<size_t>(info.st_size),
+                             PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (mapping == MAP_FAILED) return false;
+        madvise(mapping, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+
+        mapping_ = mapping;
+        mapping_size_ = static_cast<size_t>(info.st_size);
+        pos_ = static_cast<const char *>(mapping);
+        end_ = pos_ + mapping_size_;
+        eof_ = true;
+        return true;
+    }
+
+    // keeps the unread tail and appends the next chunk after it,
+    // returns false once nothing more can be read
+    bool Refill() {
+        if (eof_) return false;
+
+        size_t rest = static_cast<size_t>(end_ - pos_);
+        if (buffer_.size() < rest + kChunkSize) {
+            std::vector<char> grown(rest + kChunkSize);
+            std::memcpy(grown.data(), pos_, rest);
+            buffer_.swap(grown);
+        } else {
+            std::memmove(buffer_.data(), pos_, rest);
+        }
+
+        ssize_t got;
+        do {
+            got = read(fd_, buffer_.data() + rest, buffer_.size() - rest);
+        } while (got < 0 && errno == EINTR);
+        if (got < 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "\n Failed to read input");
+        }
+
+        pos_ = buffer_.data();
+        end_ = pos_ + rest + got;
+        eof_ = got == 0;
+        return got > 0;
+    }
+
+    bool SkipSpaces() {
+        while (true) {
+            while (pos_ != end_ && IsSpace(*pos_)) {
+                ++pos_;
+            }
+            if (pos_ != end_) return true;
+            if (!Refill()) return false;
+        }
+    }
+
+    int ReadNumber(const char *error) {
+        if (!SkipSpaces()) {
+            throw std::invalid_argument(error);
+        }
+
+        // make sure the whole token is in memory before parsing it
+        const char *token_end = pos_ + 1;
+        while (true) {
+            while (token_end != end_ && IsDigit(*token_end)) {
+                ++token_end;
+            }
+            if (token_end != end_ || eof_) break;
+
+            size_t scanned = static_cast<size_t>(token_end - pos_);
+            bool refilled = Refill();
+            token_end = pos_ + scanned;  // Refill moves the token
+            if (!refilled) break;
+        }
+
+        const char *first = pos_;
+        if (*first == '+') {
+            ++first;
+            if (first == token_end || !IsDigit(*first)) {
+                throw std::invalid_argument(error);
+            }
+        }
+
+        int value;
+        auto [ptr, ec] = std::from_chars(first, token_end, value);
+        if (ec != std::errc()) {
+            throw std::invalid_argument(error);
+        }
+        pos_ = ptr;
+        return value;
+    }
+
+   public:
+    explicit CommandReader(int fd = STDIN_FILENO) : fd_(fd) {
+        if (!TryMap()) {
+            buffer_.resize(kChunkSize);
+            pos_ = end_ = buffer_.data();
+        }
+    }
+
+    ~CommandReader() {
+        if (mapping_) munmap(mapping_, mapping_size_);
+    }
+
+    CommandReader(const CommandReader &) = delete;
+    CommandReader &operator=(const CommandReader &) = delete;
+
+    // false at the end of input, throws std::invalid_argument on bad input
+    bool Next(Command &command) {
+        if (!SkipSpaces()) return false;
+
+        command.type = *pos_++;
+        switch (command.type) {
+            case 'k':
+                command.first = ReadNumber("\n Key invalid");
+                break;
+            case 'q':
+                command.first =
+                    ReadNumber("\n Invalid first number for the request");
+                command.second =
+                    ReadNumber("\n Invalid second number for the request");
+                break;
+            default:
+                throw std::invalid_argument("\n Unknown command");
+        }
+        return true;
+    }
+};
+
+// Collects query answers in one buffer and writes them out in large blocks
+class OutputWriter final {
+   private:
+    static constexpr size_t kFlushSize = size_t{1} << 16;
+
+    int fd_;
+    std::vector<char> buffer_;
+
+   public:
+    explicit OutputWriter(int fd = STDOUT_FILENO) : fd_(fd) {
+        buffer_.reserve(kFlushSize + 32);
+    }
+
+    ~OutputWriter() { Flush(); }
+
+    OutputWriter(const OutputWriter &) = delete;
+    OutputWriter &operator=(const OutputWriter &) = delete;
+
+    // appends "<count> ", the separator range_queries has always used
+    void WriteCount(size_t count) {
+        char digits[24];
+        auto [ptr, ec] = std::to_chars(digits, digits + sizeof(digits), count);
+        buffer_.insert(buffer_.end(), digits, ptr);
+        buffer_.push_back(' ');
+        if (buffer_.size() >= kFlushSize) Flush();
+    }
+
+    void WriteChar(char c) { buffer_.push_back(c); }
+
+    void Flush() {
+        const char *data = buffer_.data();
+        size_t left = buffer_.size();
+        while (left > 0) {
+            ssize_t written = write(fd_, data, left);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            data += written;
+            left -= static_cast<size_t>(written);
+        }
+        buffer_.clear();
+    }
+};
+
+}  // namespace range_queries
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace avl_tree {
+
+// std::allocator with cache line alignment, so every block of the frozen
+// index sits in exactly one line
+template <typename U>
+struct CacheAlignedAllocator {
+    using value_type = U;
+    static constexpr std::align_val_t kAlignment{64};
+
+    CacheAlignedAllocator() = default;
+    template <typename V>
+    CacheAlignedAllocator(const CacheAlignedAllocator<V> &) {}
+
+    U *allocate(size_t count) {
+        return static_cast<U *>(::operator new(count * sizeof(U), kAlignment));
+    }
+
+    void deallocate(U *ptr, size_t) { ::operator delete(ptr, kAlignment); }
+
+    template <typename V>
+    bool operator==(const CacheAlignedAllocator<V> &) const {
+        return true;
+    }
+};
+
+// Read-only snapshot of sorted keys laid out as an implicit B+-tree whose
+// nodes are one cache line wide. The bottom level is the sorted keys
+// themselves, every level above keeps the maximum of each block below.
+// Counting keys below a bound is one block scan per level: a branchless
+// counting loop, or a few SIMD compares for int keys.
+template <typename T>
+class FrozenRangeIndex final {
+   private:
+    static constexpr size_t kBlock =
+        sizeof(T) <= 16 ? std::max<size_t>(64 / sizeof(T), 4) : 4;
+
+    std::vector<T, CacheAlignedAllocator<T>> keys_;  // levels, root first
+    std::vector<size_t> level_offsets_;  // start of each level in keys_
+    size_t size_ = 0;
+
+    // keys in block[0, kBlock) that are below key (kInclusive: or equal)
+    template <bool kInclusive>
+    static size_t CountInBlock(const T *block, const T &key) {
+#if defined(__SSE2__)
+        if constexpr (std::is_same_v<T, int>) {
+            static_assert(kBlock == 16);
+            __m128i needle = _mm_set1_epi32(key);
+            unsigned mask = 0;
+            for (size_t i = 0; i < kBlock; i += 4) {
+                __m128i keys = _mm_load_si128(
+                    reinterpret_cast<const __m128i *>(block + i));
+                __m128i hits = kInclusive ? _mm_cmpgt_epi32(keys, needle)
+                                          : _mm_cmpgt_epi32(needle, keys);
+                mask |= static_cast<unsigned>(
+                            _mm_movemask_ps(_mm_castsi128_ps(hits)))
+                        << i;
+            }
+            size_t count = static_cast<size_t>(__builtin_popcount(mask));
+            return kInclusive ? kBlock - count : count;
+        }
+#endif
+        size_t count = 0;
+        for (size_t i = 0; i < kBlock; ++i) {
+            count += kInclusive ? !(key < block[i]) : block[i] < key;
+        }
+        return count;
+    }
+
+    template <bool kInclusive>
+    [[nodiscard]] size_t CountBelow(const T &key) const {
+        if (size_ == 0) return 0;
+        // past the last key: the block maxima would not lead anywhere
+        const T &last = keys_.back();
+        if (kInclusive ? !(key < last) : last < key) return size_;
+
+        size_t block = 0;
+        for (size_t offset : level_offsets_) {
+            size_t below =
+                CountInBlock<kInclusive>(keys_.data() + offset + block * kBlock,
+                                         key);
+            block = block * kBlock + below;
+        }
+        return std::min(block, size_);
+    }
+
+   public:
+    FrozenRangeIndex() = default;
+
+    // sorted_keys must be in ascending order
+    explicit FrozenRangeIndex(const std::vector<T> &sorted_keys)
+        : size_(sorted_keys.size()) {
+        assert(std::is_sorted(sorted_keys.begin(), sorted_keys.end()));
+        if (sorted_keys.empty()) return;
+
+        // build the levels bottom-up, padding each with its last key
+        std::vector<std::vector<T>> levels;
+        levels.push_back(sorted_keys);
+        while (true) {
+            std::vector<T> &level = levels.back();
+            size_t blocks = (level.size() + kBlock - 1) / kBlock;
+            level.resize(blocks * kBlock, level.back());
+            if (blocks == 1) break;
+
+            std::vector<T> parent;
+            parent.reserve(blocks);
+            for (size_t block = 0; block < blocks; ++block) {
+                parent.push_back(level[block * kBlock + kBlock - 1]);
+            }
+            levels.push_back(std::move(parent));
+        }
+
+        size_t total = 0;
+        for (const auto &level : levels) {
+            total += level.size();
+        }
+        keys_.reserve(total);
+        for (auto level = levels.rbegin(); level != levels.rend(); ++level) {
+            level_offsets_.push_back(keys_.size());
+            keys_.insert(keys_.end(), level->begin(), level->end());
+        }
+    }
+
+    [[nodiscard]] size_t Size() const { return size_; }
+
+    [[nodiscard]] size_t CountLess(const T &key) const {
+        return CountBelow<false>(key);
+    }
+
+    [[nodiscard]] size_t CountLessEqual(const T &key) const {
+        return CountBelow<true>(key);
+    }
+
+    [[nodiscard]] size_t RangeQuery(const T &min, const T &max) const {
+        if (size_ == 0 || min > max) {
+            return 0;
+        }
+
+        return CountLessEqual(max) - CountLess(min);
+    }
+};
+
+}  // namespace avl_tree
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "tree_exceptions.hpp"
+
+namespace avl_tree {
+
+using NodeIndex = uint32_t;
+
+// index 0 is never handed out, so it doubles as the null link
+inline constexpr NodeIndex kNullIndex = 0;
+
+// node types with narrower links than NodeIndex declare their own kMaxNodes
+template <typename Node>
+constexpr size_t MaxNodesOf() {
+    if constexpr (requires { Node::kMaxNodes; }) {
+        return Node::kMaxNodes;
+    } else {
+        return std::numeric_limits<NodeIndex>::max();
+    }
+}
+
+// Slab storage for tree nodes: nodes live in fixed-size contiguous blocks and
+// are addressed by 32-bit indices. Freed slots are chained into a free list
+// through their own storage. Release() drops whole blocks without touching
+// individual slots, so the owner has to destroy live nodes first unless Node
+// is trivially destructible.
+template <typename Node, size_t kBlockBits = 12>
+class NodeArena final {
+   private:
+    static constexpr size_t kBlockSize = size_t{1} << kBlockBits;
+    static constexpr size_t kBlockMask = kBlockSize - 1;
+    static constexpr size_t kMaxNodes = MaxNodesOf<Node>();
+
+    struct Slot final {
+        alignas(Node) std::byte bytes[sizeof(Node)];
+    };
+    static_assert(sizeof(Node) >= sizeof(NodeIndex),
+                  "free list link must fit into a node slot");
+
+    std::vector<std::unique_ptr<Slot[]>> blocks_;
+    NodeIndex next_unused_ = 1;  // bump pointer, skips the null index
+    NodeIndex free_head_ = kNullIndex;
+    size_t live_count_ = 0;
+
+    Slot &GetSlot(NodeIndex index) const {
+        assert(index != kNullIndex);
+        return blocks_[index >> kBlockBits][index & kBlockMask];
+    }
+
+    NodeIndex TakeSlot() {
+        if (free_head_ != kNullIndex) {
+            NodeIndex index = free_head_;
+            free_head_ = *std::launder(
+                reinterpret_cast<NodeIndex *>(GetSlot(index).bytes));
+            return index;
+        }
+
+        if (next_unused_ == kMaxNodes) {
+            throw CapacityExceededException();
+        }
+        if ((next_unused_ >> kBlockBits) >= blocks_.size()) {
+            // default-initialised: slots stay raw until Allocate()
+            blocks_.push_back(std::unique_ptr<Slot[]>(new Slot[kBlockSize]));
+        }
+        return next_unused_++;
+    }
+
+   public:
+    NodeArena() = default;
+    ~NodeArena() = default;
+
+    NodeArena(NodeArena &&other) noexcept
+        : blocks_(std::move(other.blocks_)),
+          next_unused_(std::exchange(other.next_unused_, 1)),
+          free_head_(std::exchange(other.free_head_, kNullIndex)),
+          live_count_(std::exchange(other.live_count_, 0)) {}
+
+    NodeArena &operator=(NodeArena &&other) noexcept {
+        if (this != &other) {
+            blocks_ = std::move(other.blocks_);
+            next_unused_ = std::exchange(other.next_unused_, 1);
+            free_head_ = std::exchange(other.free_head_, kNullIndex);
+            live_count_ = std::exchange(other.live_count_, 0);
+        }
+        return *this;
+    }
+
+    NodeArena(const NodeArena &) = delete;
+    NodeArena &operator=(const NodeArena &) = delete;
+
+    template <typename... Args>
+    NodeIndex Allocate(Args &&...args) {
+        NodeIndex index = TakeSlot();
+        try {
+            ::new (static_cast<void *>(GetSlot(index).bytes))
+                Node(std::forward<Args>(args)...);
+        } catch (...) {
+            ::new (static_cast<void *>(GetSlot(index).bytes))
+                NodeIndex(free_head_);
+            free_head_ = index;
+            throw;
+        }
+        ++live_count_;
+        return index;
+    }
+
+    void Deallocate(NodeIndex index) {
+        (*this)[index].~Node();
+        ::new (static_cast<void *>(GetSlot(index).bytes)) NodeIndex(free_head_);
+        free_head_ = index;
+        --live_count_;
+    }
+
+    // frees every block in O(blocks), live nodes are not destroyed
+    void Release() noexcept {
+        blocks_.clear();
+        next_unused_ = 1;
+        free_head_ = kNullIndex;
+        live_count_ = 0;
+    }
+
+    Node &operator[](NodeIndex index) {
+        return *std::launder(reinterpret_cast<Node *>(GetSlot(index).bytes));
+    }
+
+    const Node &operator[](NodeIndex index) const {
+        return *std::launder(
+            reinterpret_cast<const Node *>(GetSlot(index).bytes));
+    }
+
+    [[nodiscard]] size_t Size() const { return live_count_; }
+
+    [[nodiscard]] size_t BlockCount() const { return blocks_.size(); }
+
+    [[nodiscard]] size_t MemoryUsage() const {
+        return blocks_.size() * kBlockSize * sizeof(Slot);
+    }
+};
+
+// Default storage policy of AVLTree: the tree rebinds it to its node type
+template <size_t kBlockBits = 12>
+struct ArenaStorage final {
+    template <typename Node>
+    using Pool = NodeArena<Node, kBlockBits>;
+};
+
+}  // namespace avl_tree
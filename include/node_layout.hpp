@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+#include "augmentation.hpp"
+#include "node_arena.hpp"
+
+namespace avl_tree {
+
+// Keys passed around by value when that is cheaper than by reference
+template <typename T>
+using KeyArg =
+    std::conditional_t<std::is_arithmetic_v<T> && sizeof(T) <= 8, T,
+                       const T &>;
+
+// Node with full-width fields, used for any key type. In multiset mode
+// (kMultiset) it also stores how many times its key was inserted, and the
+// Augment summary of its subtree unless that is NoAugmentation.
+template <typename T, bool kMultiset, typename Augment = NoAugmentation>
+class WideNode final {
+   private:
+    struct SingleOccurrence final {};
+    using Multiplicity =
+        std::conditional_t<kMultiset, size_t, SingleOccurrence>;
+
+   public:
+    T key_;
+
+   private:
+    NodeIndex left_ = kNullIndex;
+    NodeIndex right_ = kNullIndex;
+    int height_ = 1;
+    size_t desc_size = 1;  // Size of the subtree rooted at this node
+    [[no_unique_address]] Multiplicity count_{};
+    [[no_unique_address]] typename Augment::Value aggregate_{};
+
+   public:
+    explicit WideNode(const T &key) : key_(key) { SetCount(1); }
+    explicit WideNode(T &&key) : key_(std::move(key)) { SetCount(1); }
+
+    NodeIndex Left() const { return left_; }
+    NodeIndex Right() const { return right_; }
+    void SetLeft(NodeIndex child) { left_ = child; }
+    void SetRight(NodeIndex child) { right_ = child; }
+    void SetChild(bool left, NodeIndex child) {
+        left ? SetLeft(child) : SetRight(child);
+    }
+
+    int Height() const { return height_; }
+    void SetHeight(int height) { height_ = height; }
+
+    size_t SubSize() const { return desc_size; }
+    void SetSubSize(size_t size) { desc_size = size; }
+
+    size_t Count() const {
+        if constexpr (kMultiset) {
+            return count_;
+        } else {
+            return 1;
+        }
+    }
+
+    void SetCount([[maybe_unused]] size_t count) {
+        if constexpr (kMultiset) {
+            count_ = count;
+        }
+    }
+
+    const typename Augment::Value &Aggregate() const { return aggregate_; }
+    void SetAggregate(typename Augment::Value value) {
+        aggregate_ = std::move(value);
+    }
+};
+
+// Node for small arithmetic keys in set mode: 32-bit subtree size and the
+// height split across the three top bits of both child links, so an int
+// key takes 16 bytes instead of 24. Caps the arena at 2^29 nodes.
+template <typename T>
+class CompactNode final {
+   private:
+    static constexpr unsigned kLinkBits = 29;
+    static constexpr uint32_t kLinkMask = (uint32_t{1} << kLinkBits) - 1;
+
+   public:
+    T key_;
+
+   private:
+    uint32_t left_ = 1u << kLinkBits;  // height 1: low height bits in left_
+    uint32_t right_ = 0;
+    uint32_t desc_size = 1;  // Size of the subtree rooted at this node
+
+   public:
+    static constexpr size_t kMaxNodes = size_t{1} << kLinkBits;
+
+    explicit CompactNode(T key) : key_(key) {}
+
+    NodeIndex Left() const { return left_ & kLinkMask; }
+    NodeIndex Right() const { return right_ & kLinkMask; }
+    void SetLeft(NodeIndex child) { left_ = (left_ & ~kLinkMask) | child; }
+    void SetRight(NodeIndex child) { right_ = (right_ & ~kLinkMask) | child; }
+    void SetChild(bool left, NodeIndex child) {
+        left ? SetLeft(child) : SetRight(child);
+    }
+
+    int Height() const {
+        return static_cast<int>((left_ >> kLinkBits) |
+                                ((right_ >> kLinkBits) << 3));
+    }
+
+    void SetHeight(int height) {
+        auto bits = static_cast<uint32_t>(height);
+        left_ = (left_ & kLinkMask) | ((bits & 7) << kLinkBits);
+        right_ = (right_ & kLinkMask) | ((bits >> 3) << kLinkBits);
+    }
+
+    size_t SubSize() const { return desc_size; }
+    void SetSubSize(size_t size) { desc_size = static_cast<uint32_t>(size); }
+
+    size_t Count() const { return 1; }
+    void SetCount(size_t) {}
+};
+
+template <typename T, bool kMultiset, typename Augment = NoAugmentation>
+inline constexpr bool kUseCompactNode =
+    !kMultiset && std::is_same_v<Augment, NoAugmentation> &&
+    std::is_arithmetic_v<T> && sizeof(T) <= 8;
+
+template <typename T, bool kMultiset, typename Augment = NoAugmentation>
+using NodeFor =
+    std::conditional_t<kUseCompactNode<T, kMultiset, Augment>, CompactNode<T>,
+                       WideNode<T, kMultiset, Augment>>;
+
+}  // namespace avl_tree
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "frozen_range_index.hpp"
+#include "tree_exceptions.hpp"
+
+namespace avl_tree {
+
+// Set of keys drawn from a universe fixed up front, for batch jobs that see
+// every key before the first query. The universe is sorted once and indexed
+// by a FrozenRangeIndex (coordinate compression), membership is one bit per
+// universe key. A Fenwick tree over the popcounts of the 64-bit words turns
+// a rank into log2(n / 64) additions plus one popcount, and at n / 16 bytes
+// it stays in cache where a tree over the keys would not.
+template <typename T>
+class OfflineRangeCounter final {
+   private:
+    static constexpr size_t kWordBits = 64;
+
+    std::vector<T> keys_;  // the universe, sorted and distinct
+    FrozenRangeIndex<T> index_;
+    std::vector<uint64_t> present_;  // bit i: keys_[i] was inserted
+    // fenwick_[i] counts the present keys in words (i - lowbit(i), i]
+    std::vector<uint32_t> fenwick_;
+    size_t size_ = 0;
+
+   public:
+    // every key Insert will see, in any order and with repeats
+    template <typename InputIt>
+    OfflineRangeCounter(InputIt first, InputIt last) : keys_(first, last) {
+        std::sort(keys_.begin(), keys_.end());
+        keys_.erase(std::unique(keys_.begin(), keys_.end()), keys_.end());
+        if (keys_.size() > UINT32_MAX) {
+            throw CapacityExceededException();
+        }
+        index_ = FrozenRangeIndex<T>(keys_);
+        present_.assign(keys_.size() / kWordBits + 1, 0);
+        fenwick_.assign(present_.size() + 1, 0);
+    }
+
+    // number of universe keys below key (LowerIndex) or not above it
+    // (UpperIndex); a stream compressed once can be replayed by index
+    [[nodiscard]] size_t LowerIndex(const T &key) const {
+        return index_.CountLess(key);
+    }
+
+    [[nodiscard]] size_t UpperIndex(const T &key) const {
+        return index_.CountLessEqual(key);
+    }
+
+    // inserts the index-th universe key, returns false if it is present
+    bool InsertAt(size_t index) {
+        uint64_t bit = uint64_t{1} << (index % kWordBits);
+        uint64_t &word = present_[index / kWordBits];
+        if (word & bit) return false;
+
+        word |= bit;
+        ++size_;
+        for (size_t i = index / kWordBits + 1; i < fenwick_.size();
+             i += i & (~i + 1)) {
+            ++fenwick_[i];
+        }
+        return true;
+    }
+
+    // present keys among the first index universe keys
+    [[nodiscard]] size_t CountBefore(size_t index) const {
+        size_t word = index / kWordBits;
+        uint64_t below = (uint64_t{1} << (index % kWordBits)) - 1;
+        size_t count =
+            static_cast<size_t>(std::popcount(present_[word] & below));
+        for (size_t i = word; i > 0; i &= i - 1) {
+            count += fenwick_[i];
+        }
+        return count;
+    }
+
+    // returns whether the set changed, throws UnknownKeyException for a key
+    // outside the universe
+    bool Insert(const T &key) {
+        size_t index = LowerIndex(key);
+        if (index == keys_.size() || key < keys_[index]) {
+            throw UnknownKeyException();
+        }
+        return InsertAt(index);
+    }
+
+    [[nodiscard]] size_t CountLess(const T &key) const {
+        return CountBefore(LowerIndex(key));
+    }
+
+    [[nodiscard]] size_t CountLessEqual(const T &key) const {
+        return CountBefore(UpperIndex(key));
+    }
+
+    [[nodiscard]] size_t RangeQuery(const T &min, const T &max) const {
+        if (size_ == 0 || max < min) {
+            return 0;
+        }
+
+        return CountLessEqual(max) - CountLess(min);
+    }
+
+    [[nodiscard]] size_t Size() const { return size_; }
+
+    // present keys in ascending order
+    [[nodiscard]] std::vector<T> Keys() const {
+        std::vector<T> keys;
+        keys.reserve(size_);
+        for (size_t i = 0; i < keys_.size(); ++i) {
+            if (present_[i / kWordBits] >> (i % kWordBits) & 1) {
+                keys.push_back(keys_[i]);
+            }
+        }
+        return keys;
+    }
+};
+
+}  // namespace avl_tree
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace avl_tree {
+
+// AVL tree whose nodes are never modified after construction. Insert copies
+// the O(log n) nodes on the search path and publishes the new root with an
+// atomic exchange, so readers take a Snapshot and count on it without locks
+// while writers keep inserting. Nodes are shared between versions and freed
+// by reference counting once no snapshot reaches them. At most 65535 readers
+// are inside GetSnapshot at once, the next one waits for a free slot.
+template <typename T>
+class PersistentAVLTree final {
+   private:
+    struct Node;
+    using NodePtr = std::shared_ptr<const Node>;
+
+    struct Node final {
+        T key_;
+        NodePtr left_;
+        NodePtr right_;
+        int height_;
+        size_t desc_size;  // Size of the subtree rooted at this node
+    };
+
+    static int GetHeight(const NodePtr &node) {
+        return node ? node->height_ : 0;
+    }
+
+    static size_t GetSubSize(const NodePtr &node) {
+        return node ? node->desc_size : 0;
+    }
+
+    static NodePtr MakeNode(const T &key, NodePtr left, NodePtr right) {
+        int height = std::max(GetHeight(left), GetHeight(right)) + 1;
+        size_t size = GetSubSize(left) + GetSubSize(right) + 1;
+        return std::make_shared<const Node>(
+            Node{key, std::move(left), std::move(right), height, size});
+    }
+
+    // new node for key over children whose heights differ by at most two,
+    // rotated back into balance where needed
+    static NodePtr Balance(const T &key, NodePtr left, NodePtr right) {
+        int diff = GetHeight(left) - GetHeight(right);
+        if (diff > 1) {
+            if (GetHeight(left->left_) >= GetHeight(left->right_)) {
+                return MakeNode(left->key_, left->left_,
+                                MakeNode(key, left->right_, std::move(right)));
+            }
+            const Node &middle = *left->right_;
+            return MakeNode(middle.key_,
+                            MakeNode(left->key_, left->left_, middle.left_),
+                            MakeNode(key, middle.right_, std::move(right)));
+        }
+        if (diff < -1) {
+            if (GetHeight(right->right_) >= GetHeight(right->left_)) {
+                return MakeNode(right->key_,
+                                MakeNode(key, std::move(left), right->left_),
+                                right->right_);
+            }
+            const Node &middle = *right->left_;
+            return MakeNode(middle.key_,
+                            MakeNode(key, std::move(left), middle.left_),
+                            MakeNode(right->key_, middle.right_,
+                                     right->right_));
+        }
+        return MakeNode(key, std::move(left), std::move(right));
+    }
+
+    // returns node itself when key is already present, nothing is copied
+    static NodePtr InsertInto(const NodePtr &node, const T &key) {
+        if (!node) return MakeNode(key, nullptr, nullptr);
+
+        if (key < node->key_) {
+            NodePtr left = InsertInto(node->left_, key);
+            if (left == node->left_) return node;
+            return Balance(node->key_, std::move(left), node->right_);
+        }
+        if (node->key_ < key) {
+            NodePtr right = InsertInto(node->right_, key);
+            if (right == node->right_) return node;
+            return Balance(node->key_, node->left_, std::move(right));
+        }
+        return node;
+    }
+
+   public:
+    // Immutable version of the tree, cheap to copy and safe to query from
+    // any thread while the tree keeps changing
+    class Snapshot final {
+       private:
+        friend class PersistentAVLTree;
+
+        NodePtr root_;
+        uint64_t version_ = 0;
+
+        template <bool kInclusive>
+        size_t CountBelow(const T &key) const {
+            size_t result = 0;
+            const Node *node = root_.get();
+            while (node) {
+                if (kInclusive ? !(key < node->key_) : node->key_ < key) {
+                    result += GetSubSize(node->left_) + 1;
+                    node = node->right_.get();
+                } else {
+                    node = node->left_.get();
+                }
+            }
+            return result;
+        }
+
+       public:
+        Snapshot() = default;
+        Snapshot(NodePtr root, uint64_t version)
+            : root_(std::move(root)), version_(version) {}
+
+        // number of inserts that changed the tree before this snapshot
+        [[nodiscard]] uint64_t Version() const { return version_; }
+
+        [[nodiscard]] size_t Size() const { return GetSubSize(root_); }
+
+        [[nodiscard]] size_t CountLess(const T &key) const {
+            return CountBelow<false>(key);
+        }
+
+        [[nodiscard]] size_t CountLessEqual(const T &key) const {
+            return CountBelow<true>(key);
+        }
+
+        [[nodiscard]] size_t RangeQuery(const T &min, const T &max) const {
+            if (!root_ || min > max) {
+                return 0;
+            }
+
+            return CountLessEqual(max) - CountLess(min);
+        }
+
+        [[nodiscard]] int Height() const { return GetHeight(root_); }
+    };
+
+   private:
+    // a published version and the readers that still have to give back a
+    // reference to it taken before it was replaced
+    struct Published final {
+        Snapshot snapshot;
+        std::atomic<int64_t> returned = 0;
+    };
+
+    // Split reference count: the published version's address in the high
+    // 48 bits (user-space addresses fit) and, in the low 16, how many
+    // readers are copying it right now. A reader takes a reference with one
+    // compare-and-swap, so reads never wait on a lock or a writer, unless
+    // kCountMask readers are already copying. std::atomic of a shared_ptr
+    // would do, but libstdc++ guards it with a spin lock.
+    static constexpr unsigned kCountBits = 16;
+    static constexpr uint64_t kCountMask = (uint64_t{1} << kCountBits) - 1;
+
+    mutable std::atomic<uint64_t> current_;
+    std::mutex write_mutex_;  // writers build on the latest version in turn
+
+    static uint64_t Pack(const Published *published) {
+        auto address = reinterpret_cast<uintptr_t>(published);
+        assert(address >> (64 - kCountBits) == 0);
+        return uint64_t{address} << kCountBits;
+    }
+
+    static Published *Unpack(uint64_t word) {
+        return reinterpret_cast<Published *>(
+            static_cast<uintptr_t>(word >> kCountBits));
+    }
+
+    // Gives back a reference taken on published: to the shared count if it
+    // is still the current version, else to the count the writer moved the
+    // shared one to when it replaced it. The last one out frees it.
+    void Release(Published *published) const {
+        uint64_t word = current_.load(std::memory_order_acquire);
+        while (Unpack(word) == published) {
+            if (current_.compare_exchange_weak(word, word - 1,
+                                               std::memory_order_acq_rel)) {
+                return;
+            }
+        }
+        if (published->returned.fetch_add(1, std::memory_order_acq_rel) ==
+            -1) {
+            delete published;
+        }
+    }
+
+   public:
+    PersistentAVLTree() : current_(Pack(new Published())) {}
+
+    // no reader may still be inside GetSnapshot
+    ~PersistentAVLTree() {
+        delete Unpack(current_.load(std::memory_order_acquire));
+    }
+
+    PersistentAVLTree(const PersistentAVLTree &) = delete;
+    PersistentAVLTree &operator=(const PersistentAVLTree &) = delete;
+
+    // returns whether the tree changed
+    bool Insert(const T &key) {
+        std::lock_guard lock(write_mutex_);
+        // only writers free versions, so the current one stays alive here
+        const Snapshot &current =
+            Unpack(current_.load(std::memory_order_acquire))->snapshot;
+        NodePtr root = InsertInto(current.root_, key);
+        if (root == current.root_) return false;
+
+        auto *published = new Published{
+            .snapshot = Snapshot(std::move(root), current.version_ + 1)};
+        uint64_t old = current_.exchange(Pack(published),
+                                         std::memory_order_acq_rel);
+        // the readers still copying the old version give their references
+        // back to its own count from now on
+        Published *replaced = Unpack(old);
+        auto readers = static_cast<int64_t>(old & kCountMask);
+        if (replaced->returned.fetch_sub(readers, std::memory_order_acq_rel) ==
+            readers) {
+            delete replaced;
+        }
+        return true;
+    }
+
+    // The latest published version, lock-free: never waits for an insert
+    // or another reader. Only when kCountMask (65535) readers are inside
+    // GetSnapshot at once does the next one yield until one of them leaves,
+    // so the count never carries into the address.
+    [[nodiscard]] Snapshot GetSnapshot() const {
+        uint64_t word = current_.load(std::memory_order_acquire);
+        while ((word & kCountMask) == kCountMask ||
+               !current_.compare_exchange_weak(word, word + 1,
+                                               std::memory_order_acq_rel)) {
+            if ((word & kCountMask) == kCountMask) {
+                std::this_thread::yield();
+                word = current_.load(std::memory_order_acquire);
+            }
+        }
+        Published *published = Unpack(word);
+        Snapshot snapshot = published->snapshot;
+        Release(published);
+        return snapshot;
+    }
+
+    [[nodiscard]] size_t Size() const { return GetSnapshot().Size(); }
+
+    [[nodiscard]] size_t RangeQuery(const T &min, const T &max) const {
+        return GetSnapshot().RangeQuery(min, max);
+    }
+};
+
+}  // namespace avl_tree
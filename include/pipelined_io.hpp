@@ -0,0 +1,161 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "fast_io.hpp"
+#include "spsc_ring.hpp"
+
+namespace range_queries {
+
+// CommandReader and OutputWriter moved onto threads of their own: a parser
+// thread decodes the input into batches of commands, the thread calling
+// Next executes them, and a writer thread formats the answers and writes
+// them out in large blocks. The stages are linked by SpscRings of batches, so
+// parsing and formatting overlap the tree work while commands and answers
+// keep their order. Next, WriteCount, WriteChar and Flush must all be
+// called from one thread.
+class PipelinedIo final {
+   private:
+    static constexpr size_t kBatchSize = 4096;
+    static constexpr size_t kRingBatches = 16;
+
+    struct CommandBatch final {
+        std::vector<Command> commands;
+        std::exception_ptr error;  // what the reader threw after commands
+        bool last = false;
+    };
+
+    struct AnswerBatch final {
+        std::vector<size_t> counts;
+        char suffix = 0;     // written after counts unless 0
+        bool flush = false;  // flush, then count it in flushed_
+        bool last = false;
+    };
+
+    avl_tree::SpscRing<CommandBatch, kRingBatches> commands_;
+    avl_tree::SpscRing<AnswerBatch, kRingBatches> answers_;
+    std::atomic<bool> stopping_{false};  // parser may quit before the end
+    std::atomic<uint64_t> flushed_{0};
+    uint64_t flushes_requested_ = 0;
+
+    CommandBatch batch_;  // being executed
+    size_t next_ = 0;
+    AnswerBatch pending_;  // answers not handed to the writer yet
+
+    // started last, after everything they use
+    std::thread parser_;
+    std::thread writer_;
+
+    void ParseLoop(int fd) {
+        CommandBatch batch;
+        try {
+            CommandReader input(fd);
+            Command command;
+            while (input.Next(command)) {
+                batch.commands.push_back(command);
+                if (batch.commands.size() < kBatchSize) continue;
+
+                if (stopping_.load(std::memory_order_relaxed)) break;
+                commands_.Push(std::exchange(batch, {}));
+                batch.commands.reserve(kBatchSize);
+            }
+        } catch (...) {
+            batch.error = std::current_exception();
+        }
+        batch.last = true;
+        commands_.Push(std::move(batch));
+    }
+
+    void WriteLoop(int fd) {
+        OutputWriter output(fd);
+        while (true) {
+            AnswerBatch batch = answers_.Pop();
+            for (size_t count : batch.counts) {
+                output.WriteCount(count);
+            }
+            if (batch.suffix) output.WriteChar(batch.suffix);
+            if (batch.flush) {
+                output.Flush();
+                flushed_.fetch_add(1, std::memory_order_release);
+                flushed_.notify_one();
+            }
+            if (batch.last) return;
+        }
+    }
+
+    void SendAnswers() { answers_.Push(std::exchange(pending_, {})); }
+
+   public:
+    explicit PipelinedIo(int input_fd = STDIN_FILENO,
+                         int output_fd = STDOUT_FILENO)
+        : parser_([this, input_fd] { ParseLoop(input_fd); }),
+          writer_([this, output_fd] { WriteLoop(output_fd); }) {}
+
+    // writes out every answer given so far
+    ~PipelinedIo() {
+        // a parser still reading stops at its next full batch
+        stopping_.store(true, std::memory_order_relaxed);
+        while (!batch_.last) {
+            batch_ = commands_.Pop();
+        }
+        parser_.join();
+
+        pending_.last = true;
+        SendAnswers();
+        writer_.join();
+    }
+
+    PipelinedIo(const PipelinedIo &) = delete;
+    PipelinedIo &operator=(const PipelinedIo &) = delete;
+
+    // Same contract as CommandReader::Next: false at the end of input,
+    // throws what the reader threw (std::invalid_argument on bad input)
+    // once the commands before the bad token have been returned.
+    bool Next(Command &command) {
+        while (next_ == batch_.commands.size()) {
+            if (batch_.error) {
+                std::rethrow_exception(std::exchange(batch_.error, nullptr));
+            }
+            if (batch_.last) return false;
+
+            // the answers so far are formatted while this thread waits
+            if (!pending_.counts.empty()) SendAnswers();
+            batch_ = commands_.Pop();
+            next_ = 0;
+        }
+        command = batch_.commands[next_++];
+        return true;
+    }
+
+    void WriteCount(size_t count) {
+        pending_.counts.push_back(count);
+        if (pending_.counts.size() == kBatchSize) SendAnswers();
+    }
+
+    void WriteChar(char c) {
+        pending_.suffix = c;
+        SendAnswers();
+    }
+
+    // returns once everything written so far is out
+    void Flush() {
+        pending_.flush = true;
+        SendAnswers();
+        ++flushes_requested_;
+        uint64_t done = flushed_.load(std::memory_order_acquire);
+        while (done != flushes_requested_) {
+            flushed_.wait(done, std::memory_order_acquire);
+            done = flushed_.load(std::memory_order_acquire);
+        }
+    }
+};
+
+}  // namespace range_queries
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cassert>
+#include <concepts>
+#include <cstddef>
+#include <iterator>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+namespace avl_tree {
+
+// What range_queries needs from an index engine: set insertion, counting
+// range queries and iteration in ascending key order. AVLTree, BPlusTree and
+// SortedBufferIndex all model it, with different insert/query trade-offs.
+template <typename Index, typename T>
+concept RangeIndex = std::default_initializable<Index> &&
+                     requires(Index &index, const Index &view, const T &key) {
+                         { index.Insert(key) } -> std::same_as<bool>;
+                         {
+                             view.RangeQuery(key, key)
+                         } -> std::convertible_to<size_t>;
+                         { view.Size() } -> std::convertible_to<size_t>;
+                         { view.begin() } -> std::forward_iterator;
+                         { view.end() } -> std::forward_iterator;
+                     };
+
+// inserts [first, last), through the engine's BulkLoad if it has one
+template <typename T, RangeIndex<T> Index, typename InputIt>
+void InsertAll(Index &index, InputIt first, InputIt last) {
+    if constexpr (requires { index.BulkLoad(first, last); }) {
+        index.BulkLoad(first, last);
+    } else {
+        for (; first != last; ++first) {
+            index.Insert(*first);
+        }
+    }
+}
+
+// Answers queries[i] into results[i], split between the pool's threads if
+// there is one, through the engine's RangeQueryBatch if it has one. Engines
+// are only read here, which all of them allow from several threads at once.
+template <typename T, RangeIndex<T> Index>
+void RangeQueryBatch(const Index &index,
+                     std::span<const std::pair<T, T>> queries,
+                     std::span<size_t> results, ThreadPool *pool = nullptr) {
+    if constexpr (requires { index.RangeQueryBatch(queries, results, pool); }) {
+        index.RangeQueryBatch(queries, results, pool);
+        return;
+    }
+
+    assert(results.size() >= queries.size());
+    auto run = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            results[i] = index.RangeQuery(queries[i].first, queries[i].second);
+        }
+    };
+
+    if (pool) {
+        pool->ParallelFor(queries.size(), kMinQueriesPerTask, run);
+    } else {
+        run(0, queries.size());
+    }
+}
+
+// the keys in ascending order
+template <typename T, RangeIndex<T> Index>
+std::vector<T> SortedKeys(const Index &index) {
+    std::vector<T> keys;
+    keys.reserve(index.Size());
+    keys.insert(keys.end(), index.begin(), index.end());
+    return keys;
+}
+
+}  // namespace avl_tree
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+#include "avl_tree.hpp"
+
+namespace avl_tree {
+
+// AVLTree split into range partitions that can be used from many threads.
+// Shard i owns the keys in [bounds_[i - 1], bounds_[i]) and has its own
+// lock and node pool, so inserts into different shards do not contend.
+// Until the first rebalance every key lives in shard 0; the bounds are then
+// placed at the quantiles of the stored keys and moved again whenever one
+// shard grows well past the average.
+//
+// Inserts and queries share no lock or counter: they read the bounds
+// through an atomic pointer and lock only the shards they touch. A
+// rebalance locks every shard and publishes new bounds before unlocking,
+// so an operation that still sees its bounds after locking its shards
+// knows they are current, and otherwise retries. Bounds replaced by a
+// rebalance are kept until the tree is destroyed, so a reader never finds
+// them freed under it; the total grows by at least a 1/shards fraction
+// between two automatic rebalances, so there are O(shards * log n) of them.
+//
+// Every operation is atomic within the shards it touches, a RangeQuery
+// spanning several shards may see inserts made while it runs.
+template <typename T, typename NodeStorage = ArenaStorage<>,
+          bool kMultiset = false>
+class ShardedAVLTree final {
+   private:
+    using Tree = AVLTree<T, std::less<T>, NodeStorage, kMultiset>;
+
+    // shards below this size are never worth rebalancing
+    static constexpr size_t kMinShardSize = 1024;
+    // rebalance once a shard holds this many times the average
+    static constexpr size_t kSkewFactor = 2;
+    // a shard checks for skew once per this many inserts, reading the other
+    // shards' sizes on every insert would make their cache lines bounce
+    static constexpr size_t kSkewCheckInterval = 256;
+
+    using Bounds = std::vector<T>;
+
+    struct alignas(64) Shard final {
+        mutable std::shared_mutex mutex;
+        Tree tree;
+        std::atomic<size_t> size = 0;  // tree.Size(), readable without mutex
+    };
+
+    std::vector<Shard> shards_;
+    // the current bounds, replaced only with every shard locked
+    std::atomic<const Bounds *> bounds_;
+    // serialises rebalances and owns every bounds vector ever published
+    mutable std::mutex rebalance_mutex_;
+    std::vector<std::unique_ptr<const Bounds>> retired_bounds_;
+
+    static size_t OwnerOf(const Bounds &bounds, const T &key) {
+        return static_cast<size_t>(
+            std::upper_bound(bounds.begin(), bounds.end(), key) -
+            bounds.begin());
+    }
+
+    const Bounds &LoadBounds() const {
+        return *bounds_.load(std::memory_order_acquire);
+    }
+
+    // whether bounds are still the current ones, the caller holds a lock on
+    // a shard so they cannot change while it does
+    bool StillCurrent(const Bounds &bounds) const {
+        return bounds_.load(std::memory_order_acquire) == &bounds;
+    }
+
+    bool IsSkewed(size_t shard_size) const {
+        size_t total = Size();
+        if (total < shards_.size() * kMinShardSize) return false;
+        return shard_size > kSkewFactor * (total / shards_.size()) +
+                                kMinShardSize;
+    }
+
+    // Moves part into target, on the side given by kAppend. part is rebuilt
+    // in a pool of its own first: a plain Join could leave two shards
+    // sharing one pool, and pools are not thread-safe.
+    template <bool kAppend>
+    static void MoveInto(Tree &target, Tree &&part) {
+        Tree copy = Tree::FromRange(part.begin(), part.end());
+        part = Tree();
+        target = kAppend ? Tree::Join(std::move(target), std::move(copy))
+                         : Tree::Join(std::move(copy), std::move(target));
+    }
+
+    // k-th smallest key over all shards, caller holds every shard lock
+    const T &SelectLocked(size_t k) const {
+        for (const auto &shard : shards_) {
+            size_t size = shard.tree.Size();
+            if (k < size) return shard.tree.Select(k);
+            k -= size;
+        }
+        throw IndexOutOfRangeException();
+    }
+
+    // caller holds rebalance_mutex_ and every shard lock
+    void RebalanceLocked() {
+        size_t total = Size();
+        size_t count = shards_.size();
+        if (count == 1 || total < count * kMinShardSize) return;
+
+        std::vector<T> bounds;
+        bounds.reserve(count - 1);
+        for (size_t i = 1; i < count; ++i) {
+            bounds.push_back(SelectLocked(i * total / count));
+        }
+
+        // make shard i hold exactly the keys below bounds[i], left to right:
+        // the excess goes to the front of shard i + 1, a deficit is pulled
+        // from the shards to the right
+        for (size_t i = 0; i + 1 < count; ++i) {
+            Tree &tree = shards_[i].tree;
+            auto [keep, excess] = tree.Split(bounds[i]);
+            tree = std::move(keep);
+            if (excess.Size() > 0) {
+                MoveInto<false>(shards_[i + 1].tree, std::move(excess));
+                continue;
+            }
+
+            for (size_t j = i + 1; j < count; ++j) {
+                auto [below, rest] = shards_[j].tree.Split(bounds[i]);
+                shards_[j].tree = std::move(rest);
+                if (below.Size() > 0) {
+                    MoveInto<true>(tree, std::move(below));
+                }
+                if (shards_[j].tree.Size() > 0) break;
+            }
+        }
+
+        for (auto &shard : shards_) {
+            shard.size.store(shard.tree.Size(), std::memory_order_relaxed);
+        }
+        retired_bounds_.push_back(
+            std::make_unique<const Bounds>(std::move(bounds)));
+        bounds_.store(retired_bounds_.back().get(), std::memory_order_release);
+    }
+
+    // every shard locked, in index order like every other multi-shard lock
+    template <typename Lock>
+    std::vector<Lock> LockAll() const {
+        std::vector<Lock> locks;
+        locks.reserve(shards_.size());
+        for (const Shard &shard : shards_) {
+            locks.emplace_back(shard.mutex);
+        }
+        return locks;
+    }
+
+    void Rebalance(bool only_if_skewed) {
+        std::lock_guard rebalance(rebalance_mutex_);
+        auto locks = LockAll<std::unique_lock<std::shared_mutex>>();
+        // another thread may have rebalanced in the meantime
+        if (only_if_skewed &&
+            std::none_of(shards_.begin(), shards_.end(),
+                         [this](const Shard &shard) {
+                             return IsSkewed(shard.tree.Size());
+                         })) {
+            return;
+        }
+        RebalanceLocked();
+    }
+
+   public:
+    explicit ShardedAVLTree(size_t shards)
+        : shards_(std::max<size_t>(shards, 1)) {
+        retired_bounds_.push_back(std::make_unique<const Bounds>());
+        bounds_.store(retired_bounds_.back().get(), std::memory_order_release);
+    }
+
+    ShardedAVLTree(const ShardedAVLTree &) = delete;
+    ShardedAVLTree &operator=(const ShardedAVLTree &) = delete;
+
+    // returns whether the tree changed, may rebalance the shards afterwards
+    bool Insert(const T &key) {
+        bool inserted;
+        size_t shard_size;
+        while (true) {
+            const Bounds &bounds = LoadBounds();
+            Shard &shard = shards_[OwnerOf(bounds, key)];
+            std::unique_lock lock(shard.mutex);
+            if (!StillCurrent(bounds)) continue;
+
+            inserted = shard.tree.Insert(key);
+            shard_size = shard.tree.Size();
+            shard.size.store(shard_size, std::memory_order_relaxed);
+            break;
+        }
+
+        if (inserted && shard_size % kSkewCheckInterval == 0 &&
+            IsSkewed(shard_size)) {
+            Rebalance(true);
+        }
+        return inserted;
+    }
+
+    // Number of keys in [min, max]. Shards lying fully inside the range
+    // only contribute their cached sizes, the two edge shards are queried.
+    [[nodiscard]] size_t RangeQuery(const T &min, const T &max) const {
+        if (min > max) return 0;
+
+        while (true) {
+            const Bounds &bounds = LoadBounds();
+            size_t first = OwnerOf(bounds, min);
+            size_t last = OwnerOf(bounds, max);
+            const Shard &low = shards_[first];
+            const Shard &high = shards_[last];
+            std::shared_lock low_lock(low.mutex);
+            if (first == last) {
+                if (!StillCurrent(bounds)) continue;
+                return low.tree.RangeQuery(min, max);
+            }
+            std::shared_lock high_lock(high.mutex);
+            if (!StillCurrent(bounds)) continue;
+
+            size_t result = low.tree.Size() - low.tree.CountLess(min) +
+                            high.tree.CountLessEqual(max);
+            for (size_t i = first + 1; i < last; ++i) {
+                result += shards_[i].size.load(std::memory_order_relaxed);
+            }
+            return result;
+        }
+    }
+
+    // redistributes the keys evenly over the shards
+    void Rebalance() { Rebalance(false); }
+
+    // sum of the shard sizes, exact once concurrent inserts have returned
+    [[nodiscard]] size_t Size() const {
+        size_t total = 0;
+        for (const Shard &shard : shards_) {
+            total += shard.size.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    [[nodiscard]] size_t ShardCount() const { return shards_.size(); }
+
+    [[nodiscard]] std::vector<size_t> ShardSizes() const {
+        std::vector<size_t> sizes;
+        sizes.reserve(shards_.size());
+        for (const auto &shard : shards_) {
+            sizes.push_back(shard.size.load(std::memory_order_relaxed));
+        }
+        return sizes;
+    }
+
+    // every shard is a valid tree and holds only keys inside its bounds
+    [[nodiscard]] bool IsValid() const {
+        std::lock_guard rebalance(rebalance_mutex_);
+        auto locks = LockAll<std::shared_lock<std::shared_mutex>>();
+        const Bounds &bounds = LoadBounds();
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            const Tree &tree = shards_[i].tree;
+            if (!tree.IsValid()) return false;
+            if (tree.Size() == 0) continue;
+            if (i > 0 && i <= bounds.size() &&
+                tree.CountLess(bounds[i - 1]) != 0) {
+                return false;
+            }
+            if (i < bounds.size() &&
+                tree.CountLess(bounds[i]) != tree.Size()) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+}  // namespace avl_tree
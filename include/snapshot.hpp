@@ -0,0 +1,313 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include "tree_exceptions.hpp"
+
+namespace avl_tree {
+
+// On-disk snapshot of a tree, native byte order:
+//   Header (64 bytes)
+//   keys         key_count sorted distinct keys, zero padded to 8 bytes
+//   cumulative   key_count uint64_t running occurrence counts, multiset only
+// The checksum covers the header (with the checksum field zeroed) and both
+// arrays. The sorted keys are all a balanced rebuild needs, and they can
+// answer counting queries by binary search straight from a mapping.
+namespace snapshot {
+
+inline constexpr char kMagic[8] = {'A', 'V', 'L', 'S', 'N', 'A', 'P', '\0'};
+inline constexpr uint32_t kFormatVersion = 1;
+inline constexpr uint32_t kMultisetFlag = 1;
+
+struct Header final {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t key_size;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t key_count;  // distinct keys
+    uint64_t total;      // keys with repeats
+    uint64_t checksum;
+    uint64_t sequence;  // caller-defined, the WAL records already included
+    uint8_t padding[8];
+};
+static_assert(sizeof(Header) == 64);
+
+// multiply-rotate hash over 8-byte words, a few GB/s
+inline uint64_t Checksum(const void *data, size_t size, uint64_t hash) {
+    constexpr uint64_t kMultiplier = 0xff51afd7ed558ccdULL;
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, 8);
+        hash = std::rotl(hash ^ word, 31) * kMultiplier;
+    }
+    for (; i < size; ++i) {
+        hash = std::rotl(hash ^ bytes[i], 31) * kMultiplier;
+    }
+    return hash ^ (hash >> 29);
+}
+
+inline uint64_t Checksum(Header header, std::span<const std::byte> keys,
+                         std::span<const std::byte> cumulative) {
+    header.checksum = 0;
+    uint64_t hash = Checksum(&header, sizeof(header), 0x9e3779b97f4a7c15ULL);
+    hash = Checksum(keys.data(), keys.size(), hash);
+    return Checksum(cumulative.data(), cumulative.size(), hash);
+}
+
+inline size_t PaddedSize(size_t bytes) { return (bytes + 7) & ~size_t{7}; }
+
+inline void WriteAll(int fd, const void *data, size_t size) {
+    const auto *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(),
+                                    "\n Failed to write snapshot");
+        }
+        bytes += written;
+        size -= static_cast<size_t>(written);
+    }
+}
+
+// Makes a rename or creation of path durable: syncing the file itself does
+// not write the directory entry that points to it
+inline void SyncParentDirectory(const std::string &path) {
+    std::filesystem::path parent = std::filesystem::path(path).parent_path();
+    if (parent.empty()) parent = ".";
+    int fd = open(parent.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(),
+                                "\n Failed to open directory");
+    }
+    if (fsync(fd) != 0) {
+        int error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(),
+                                "\n Failed to sync directory");
+    }
+    close(fd);
+}
+
+// Writes keys (sorted, distinct) and, for multisets, the running counts to
+// path, sequence is stored as is. The file is written next to path and
+// renamed over it once synced, so a crash leaves either the old snapshot or
+// the new one. Returns once the rename is on disk too.
+template <typename T>
+void Write(const std::string &path, std::span<const T> keys,
+           std::span<const uint64_t> cumulative, bool multiset,
+           uint64_t sequence) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "snapshots store keys as raw bytes");
+
+    Header header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.format_version = kFormatVersion;
+    header.key_size = sizeof(T);
+    header.flags = multiset ? kMultisetFlag : 0;
+    header.key_count = keys.size();
+    header.total = multiset && !cumulative.empty() ? cumulative.back()
+                                                   : keys.size();
+    header.sequence = sequence;
+    header.checksum =
+        Checksum(header, std::as_bytes(keys), std::as_bytes(cumulative));
+
+    std::string temp_path = path + ".tmp";
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(),
+                                "\n Failed to create snapshot");
+    }
+    try {
+        WriteAll(fd, &header, sizeof(header));
+        WriteAll(fd, keys.data(), keys.size_bytes());
+        const char zeros[8] = {};
+        WriteAll(fd, zeros, PaddedSize(keys.size_bytes()) - keys.size_bytes());
+        WriteAll(fd, cumulative.data(), cumulative.size_bytes());
+        if (fsync(fd) != 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "\n Failed to sync snapshot");
+        }
+    } catch (...) {
+        close(fd);
+        unlink(temp_path.c_str());
+        throw;
+    }
+    close(fd);
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        throw std::system_error(errno, std::generic_category(),
+                                "\n Failed to replace snapshot");
+    }
+    SyncParentDirectory(path);
+}
+
+}  // namespace snapshot
+
+// Read-only view of a snapshot file. The file is mmap-ed and queried in
+// place: opening costs one checksum pass (or nothing with verify = false)
+// and no keys are copied.
+template <typename T>
+class MappedSnapshot final {
+   private:
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "snapshots store keys as raw bytes");
+
+    void *mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    std::span<const T> keys_;
+    std::span<const uint64_t> cumulative_;  // empty unless multiset
+    size_t total_ = 0;
+    uint64_t sequence_ = 0;
+
+    // occurrences among the first index distinct keys
+    size_t CountBefore(size_t index) const {
+        if (cumulative_.empty() || index == 0) return index;
+        return static_cast<size_t>(cumulative_[index - 1]);
+    }
+
+    void Map(const std::string &path, bool verify) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "\n Failed to open snapshot");
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            int error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(),
+                                    "\n Failed to open snapshot");
+        }
+        mapping_size_ = static_cast<size_t>(info.st_size);
+        if (mapping_size_ < sizeof(snapshot::Header)) {
+            close(fd);
+            throw SnapshotFormatException();
+        }
+        void *mapping =
+            mmap(nullptr, mapping_size_, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "\n Failed to map snapshot");
+        }
+        mapping_ = mapping;
+
+        snapshot::Header header;
+        std::memcpy(&header, mapping_, sizeof(header));
+        bool multiset = header.flags & snapshot::kMultisetFlag;
+        size_t keys_bytes = snapshot::PaddedSize(header.key_count * sizeof(T));
+        size_t cumulative_bytes =
+            multiset ? header.key_count * sizeof(uint64_t) : 0;
+        if (std::memcmp(header.magic, snapshot::kMagic,
+                        sizeof(snapshot::kMagic)) != 0 ||
+            header.format_version != snapshot::kFormatVersion ||
+            header.key_size != sizeof(T) ||
+            header.key_count > mapping_size_ / sizeof(T) ||
+            mapping_size_ !=
+                sizeof(header) + keys_bytes + cumulative_bytes) {
+            throw SnapshotFormatException();
+        }
+
+        const auto *base = static_cast<const std::byte *>(mapping_);
+        keys_ = {reinterpret_cast<const T *>(base + sizeof(header)),
+                 static_cast<size_t>(header.key_count)};
+        if (multiset) {
+            cumulative_ = {reinterpret_cast<const uint64_t *>(
+                               base + sizeof(header) + keys_bytes),
+                           static_cast<size_t>(header.key_count)};
+        }
+        total_ = static_cast<size_t>(header.total);
+        sequence_ = header.sequence;
+        if (total_ != (multiset && !cumulative_.empty() ? cumulative_.back()
+                                                        : keys_.size())) {
+            throw SnapshotFormatException();
+        }
+
+        if (verify &&
+            snapshot::Checksum(header, std::as_bytes(keys_),
+                               std::as_bytes(cumulative_)) != header.checksum) {
+            throw SnapshotFormatException();
+        }
+    }
+
+   public:
+    explicit MappedSnapshot(const std::string &path, bool verify = true) {
+        try {
+            Map(path, verify);
+        } catch (...) {
+            if (mapping_) munmap(mapping_, mapping_size_);
+            throw;
+        }
+    }
+
+    ~MappedSnapshot() {
+        if (mapping_) munmap(mapping_, mapping_size_);
+    }
+
+    MappedSnapshot(const MappedSnapshot &) = delete;
+    MappedSnapshot &operator=(const MappedSnapshot &) = delete;
+
+    // distinct keys in ascending order
+    [[nodiscard]] std::span<const T> Keys() const { return keys_; }
+
+    // running occurrence counts per distinct key, empty for sets
+    [[nodiscard]] std::span<const uint64_t> CumulativeCounts() const {
+        return cumulative_;
+    }
+
+    [[nodiscard]] size_t Size() const { return total_; }
+
+    // the number passed to SaveSnapshot
+    [[nodiscard]] uint64_t Sequence() const { return sequence_; }
+
+    [[nodiscard]] size_t CountLess(const T &key) const {
+        auto it = std::lower_bound(keys_.begin(), keys_.end(), key);
+        return CountBefore(static_cast<size_t>(it - keys_.begin()));
+    }
+
+    [[nodiscard]] size_t CountLessEqual(const T &key) const {
+        auto it = std::upper_bound(keys_.begin(), keys_.end(), key);
+        return CountBefore(static_cast<size_t>(it - keys_.begin()));
+    }
+
+    [[nodiscard]] size_t RangeQuery(const T &min, const T &max) const {
+        if (keys_.empty() || min > max) {
+            return 0;
+        }
+
+        return CountLessEqual(max) - CountLess(min);
+    }
+
+    // k-th smallest key, counting repeats
+    [[nodiscard]] const T &Select(size_t k) const {
+        if (k >= total_) {
+            throw IndexOutOfRangeException();
+        }
+        if (cumulative_.empty()) return keys_[k];
+
+        auto it = std::upper_bound(cumulative_.begin(), cumulative_.end(),
+                                   static_cast<uint64_t>(k));
+        return keys_[static_cast<size_t>(it - cumulative_.begin())];
+    }
+};
+
+}  // namespace avl_tree
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <iterator>
+#include <span>
+#include <vector>
+
+namespace avl_tree {
+
+// Distinct keys kept as one big sorted run plus a small sorted write buffer,
+// LSM style. Inserts go to the buffer, which is merged into the run once it
+// holds about sqrt(n) keys, so an insert costs O(sqrt(n)) amortised moves.
+// Queries are four binary searches over two flat arrays and iteration is a
+// merge of the two, which suits read-mostly workloads.
+template <typename T>
+class SortedBufferIndex final {
+   private:
+    static constexpr size_t kMinBuffer = 64;
+
+    std::vector<T> run_;     // sorted, distinct
+    std::vector<T> buffer_;  // sorted, distinct, disjoint from run_
+
+    static bool Contains(std::span<const T> keys, const T &key) {
+        auto it = std::lower_bound(keys.begin(), keys.end(), key);
+        return it != keys.end() && !(key < *it);
+    }
+
+    static size_t CountIn(std::span<const T> keys, const T &min,
+                          const T &max) {
+        return static_cast<size_t>(
+            std::upper_bound(keys.begin(), keys.end(), max) -
+            std::lower_bound(keys.begin(), keys.end(), min));
+    }
+
+    size_t BufferLimit() const {
+        return std::max(kMinBuffer, static_cast<size_t>(std::sqrt(
+                                        static_cast<double>(run_.size()))));
+    }
+
+    // merges the buffer into the run from the back, in place
+    void Merge() {
+        size_t old_size = run_.size();
+        run_.resize(old_size + buffer_.size());
+        auto out = run_.end();
+        auto from_run = run_.begin() + static_cast<std::ptrdiff_t>(old_size);
+        auto from_buffer = buffer_.end();
+        while (from_buffer != buffer_.begin()) {
+            if (from_run != run_.begin() &&
+                *(from_buffer - 1) < *(from_run - 1)) {
+                *--out = std::move(*--from_run);
+            } else {
+                *--out = std::move(*--from_buffer);
+            }
+        }
+        buffer_.clear();
+    }
+
+   public:
+    // Forward iterator merging the run and the buffer
+    class ConstIterator final {
+       private:
+        friend class SortedBufferIndex;
+
+        const T *run_ = nullptr;
+        const T *run_end_ = nullptr;
+        const T *buffer_ = nullptr;
+        const T *buffer_end_ = nullptr;
+
+        ConstIterator(std::span<const T> run, std::span<const T> buffer)
+            : run_(run.data()),
+              run_end_(run.data() + run.size()),
+              buffer_(buffer.data()),
+              buffer_end_(buffer.data() + buffer.size()) {}
+
+        bool FromBuffer() const {
+            return run_ == run_end_ ||
+                   (buffer_ != buffer_end_ && *buffer_ < *run_);
+        }
+
+       public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T *;
+        using reference = const T &;
+
+        ConstIterator() = default;
+
+        reference operator*() const { return FromBuffer() ? *buffer_ : *run_; }
+        pointer operator->() const { return &**this; }
+
+        ConstIterator &operator++() {
+            if (FromBuffer()) {
+                ++buffer_;
+            } else {
+                ++run_;
+            }
+            return *this;
+        }
+
+        ConstIterator operator++(int) {
+            ConstIterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool operator==(const ConstIterator &other) const {
+            return run_ == other.run_ && buffer_ == other.buffer_;
+        }
+    };
+
+    SortedBufferIndex() = default;
+
+    // returns whether the index changed, duplicates are not stored
+    bool Insert(const T &key) {
+        if (Contains(run_, key)) return false;
+        auto it = std::lower_bound(buffer_.begin(), buffer_.end(), key);
+        if (it != buffer_.end() && !(key < *it)) return false;
+
+        buffer_.insert(it, key);
+        if (buffer_.size() >= BufferLimit()) Merge();
+        return true;
+    }
+
+    // Adds a batch of keys. Batches smaller than the buffer go through
+    // Insert, larger ones are sorted and merged into the run in one pass.
+    template <typename InputIt>
+    void BulkLoad(InputIt first, InputIt last) {
+        std::vector<T> batch(first, last);
+        if (batch.size() < BufferLimit()) {
+            for (const T &key : batch) {
+                Insert(key);
+            }
+            return;
+        }
+
+        Merge();
+        std::sort(batch.begin(), batch.end());
+        batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+        std::erase_if(batch,
+                      [&](const T &key) { return Contains(run_, key); });
+        buffer_ = std::move(batch);
+        Merge();
+    }
+
+    [[nodiscard]] size_t RangeQuery(const T &min, const T &max) const {
+        if (max < min) {
+            return 0;
+        }
+
+        return CountIn(run_, min, max) + CountIn(buffer_, min, max);
+    }
+
+    [[nodiscard]] size_t Size() const { return run_.size() + buffer_.size(); }
+
+    ConstIterator begin() const { return ConstIterator(run_, buffer_); }
+    ConstIterator end() const {
+        return ConstIterator(std::span<const T>(run_).subspan(run_.size()),
+                             std::span<const T>(buffer_).subspan(
+                                 buffer_.size()));
+    }
+};
+
+}  // namespace avl_tree
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <utility>
+
+namespace avl_tree {
+
+// Bounded lock-free queue between exactly one producer thread and one
+// consumer thread. Each side owns one index and only reads the other's, so
+// a transfer is one release store; Push blocks while the ring is full and
+// Pop while it is empty, sleeping in std::atomic::wait rather than spinning.
+// Meant for handing over large items (batches), one slot per item.
+template <typename T, size_t kCapacity>
+class SpscRing final {
+   private:
+    static_assert(std::has_single_bit(kCapacity),
+                  "kCapacity must be a power of two");
+    static constexpr size_t kMask = kCapacity - 1;
+
+    // on separate cache lines so the two threads do not share one
+    alignas(64) std::atomic<size_t> head_{0};  // next slot to pop
+    alignas(64) std::atomic<size_t> tail_{0};  // next slot to push
+    alignas(64) std::array<T, kCapacity> slots_{};
+
+   public:
+    SpscRing() = default;
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    // producer only
+    void Push(T value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        while (tail - head == kCapacity) {
+            head_.wait(head, std::memory_order_acquire);
+            head = head_.load(std::memory_order_acquire);
+        }
+        slots_[tail & kMask] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        tail_.notify_one();
+    }
+
+    // consumer only
+    T Pop() {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        while (tail == head) {
+            tail_.wait(tail, std::memory_order_acquire);
+            tail = tail_.load(std::memory_order_acquire);
+        }
+        T value = std::move(slots_[head & kMask]);
+        head_.store(head + 1, std::memory_order_release);
+        head_.notify_one();
+        return value;
+    }
+};
+
+}  // namespace avl_tree
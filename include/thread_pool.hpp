@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <latch>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace avl_tree {
+
+// smallest slice of a query batch worth handing to another thread
+inline constexpr size_t kMinQueriesPerTask = 1024;
+
+// Fixed set of worker threads fed from one task queue. The thread calling
+// ParallelFor works on a chunk as well, so a pool of N threads keeps N cores
+// busy with N - 1 workers.
+class ThreadPool final {
+   private:
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    bool stopping_ = false;
+
+    void WorkerLoop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock(mutex_);
+                ready_.wait(lock,
+                            [this] { return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty()) return;
+                task = std::move(tasks_.front());
+                tasks_.pop();
+            }
+            task();
+        }
+    }
+
+   public:
+    explicit ThreadPool(size_t threads) {
+        for (size_t i = 1; i < threads; ++i) {
+            workers_.emplace_back([this] { WorkerLoop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto &worker : workers_) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // threads taking part in ParallelFor, the caller included
+    [[nodiscard]] size_t Size() const { return workers_.size() + 1; }
+
+    // Splits [0, count) into contiguous chunks of at least min_chunk items,
+    // or one chunk if count is smaller, runs body(begin, end) on each and
+    // returns when all chunks are done. body must not throw.
+    template <typename Body>
+    void ParallelFor(size_t count, size_t min_chunk, const Body &body) {
+        if (count == 0) return;
+        size_t chunks =
+            std::clamp(count / std::max(min_chunk, size_t{1}), size_t{1},
+                       Size());
+        if (chunks == 1) {
+            body(size_t{0}, count);
+            return;
+        }
+
+        // the first count % chunks chunks take one item more
+        size_t chunk_size = count / chunks;
+        size_t longer = count % chunks;
+        auto begin_of = [&](size_t chunk) {
+            return chunk * chunk_size + std::min(chunk, longer);
+        };
+        std::latch done(static_cast<std::ptrdiff_t>(chunks - 1));
+        {
+            std::lock_guard lock(mutex_);
+            for (size_t chunk = 1; chunk < chunks; ++chunk) {
+                size_t begin = begin_of(chunk);
+                size_t end = begin_of(chunk + 1);
+                tasks_.emplace([&body, &done, begin, end] {
+                    body(begin, end);
+                    done.count_down();
+                });
+            }
+        }
+        ready_.notify_all();
+
+        body(size_t{0}, begin_of(1));
+        done.wait();
+    }
+};
+
+}  // namespace avl_tree
@@ -19,4 +19,44 @@ class NodeNullException : public AVLException {
         : AVLException("\n Internal error: encountered null node") {}
 };
 
+class IndexOutOfRangeException : public AVLException {
+   public:
+    IndexOutOfRangeException()
+        : AVLException("\n Index is out of the tree range") {}
+};
+
+class CapacityExceededException : public AVLException {
+   public:
+    CapacityExceededException()
+        : AVLException("\n Tree node capacity exceeded") {}
+};
+
+class UnorderedJoinException : public AVLException {
+   public:
+    UnorderedJoinException()
+        : AVLException(
+              "\n Keys of the left tree must be below the keys of the right "
+              "tree") {}
+};
+
+class SnapshotFormatException : public AVLException {
+   public:
+    SnapshotFormatException()
+        : AVLException("\n Snapshot file is corrupted or has another format") {
+    }
+};
+
+class LogFormatException : public AVLException {
+   public:
+    LogFormatException()
+        : AVLException(
+              "\n Write-ahead log is corrupted or has another format") {}
+};
+
+class UnknownKeyException : public AVLException {
+   public:
+    UnknownKeyException()
+        : AVLException("\n Key is not in the universe given up front") {}
+};
+
 }  // namespace avl_tree
\ No newline at end of file
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace avl_tree {
+
+// AVLTree counts its hot-path events only when built with AVL_TREE_STATS
+// (cmake -DSTATS=ON). Otherwise TreeStats is empty and every Record call
+// compiles to nothing.
+#ifdef AVL_TREE_STATS
+inline constexpr bool kStatsEnabled = true;
+#else
+inline constexpr bool kStatsEnabled = false;
+#endif
+
+enum class TreeEvent : size_t {
+    kLeftRotation,
+    kRightRotation,
+    kComparison,  // key comparisons of descents by key
+    kRangeQuery,
+    kNodeVisit,        // nodes visited by range query descents
+    kDuplicateInsert,  // inserts rejected as duplicates
+};
+inline constexpr size_t kTreeEventCount = 6;
+
+// what a tree reports: its event counts (zero without AVL_TREE_STATS) and
+// its shape
+struct TreeCounters final {
+    uint64_t left_rotations = 0;
+    uint64_t right_rotations = 0;
+    uint64_t comparisons = 0;
+    uint64_t range_queries = 0;
+    uint64_t nodes_visited = 0;
+    uint64_t duplicate_inserts = 0;
+    int max_height = 0;  // the largest height the tree ever had
+    size_t node_bytes = 0;
+};
+
+// Event counters of one tree. Queries may run on several threads at once,
+// so the counts are relaxed atomics; descents add up locally and record
+// once.
+class TreeStats final {
+   public:
+    TreeStats() = default;
+    TreeStats(const TreeStats &other) { *this = other; }
+
+    TreeStats &operator=(const TreeStats &other) {
+#ifdef AVL_TREE_STATS
+        for (size_t i = 0; i < kTreeEventCount; ++i) {
+            counters_[i].store(other.counters_[i].load(kOrder), kOrder);
+        }
+        max_height_ = other.max_height_;
+#else
+        (void)other;
+#endif
+        return *this;
+    }
+
+    void Record(TreeEvent event, uint64_t times = 1) {
+#ifdef AVL_TREE_STATS
+        counters_[static_cast<size_t>(event)].fetch_add(times, kOrder);
+#else
+        (void)event;
+        (void)times;
+#endif
+    }
+
+    // called by writers only, which a tree never runs concurrently
+    void RecordHeight(int height) {
+#ifdef AVL_TREE_STATS
+        max_height_ = std::max(max_height_, height);
+#else
+        (void)height;
+#endif
+    }
+
+    [[nodiscard]] uint64_t Get(TreeEvent event) const {
+#ifdef AVL_TREE_STATS
+        return counters_[static_cast<size_t>(event)].load(kOrder);
+#else
+        (void)event;
+        return 0;
+#endif
+    }
+
+    [[nodiscard]] int MaxHeight() const {
+#ifdef AVL_TREE_STATS
+        return max_height_;
+#else
+        return 0;
+#endif
+    }
+
+    void Reset() { *this = TreeStats(); }
+
+   private:
+#ifdef AVL_TREE_STATS
+    static constexpr std::memory_order kOrder = std::memory_order_relaxed;
+
+    std::array<std::atomic<uint64_t>, kTreeEventCount> counters_{};
+    int max_height_ = 0;
+#endif
+};
+
+// Latencies in power-of-two buckets: bucket 0 holds samples under 1 ns,
+// bucket b those in [2^(b-1), 2^b) ns. Not thread-safe.
+class LatencyHistogram final {
+   public:
+    static constexpr size_t kBuckets = 48;
+
+    void Record(std::chrono::nanoseconds latency) {
+        auto ns = static_cast<uint64_t>(std::max<int64_t>(latency.count(), 0));
+        size_t bucket = std::min<size_t>(std::bit_width(ns), kBuckets - 1);
+        ++buckets_[bucket];
+        ++count_;
+        total_ns_ += ns;
+        max_ns_ = std::max(max_ns_, ns);
+    }
+
+    [[nodiscard]] uint64_t Count() const { return count_; }
+
+    [[nodiscard]] std::chrono::nanoseconds Mean() const {
+        return std::chrono::nanoseconds(count_ ? total_ns_ / count_ : 0);
+    }
+
+    [[nodiscard]] std::chrono::nanoseconds Max() const {
+        return std::chrono::nanoseconds(max_ns_);
+    }
+
+    // upper bound of the bucket holding the q-quantile, q in [0, 1]
+    [[nodiscard]] std::chrono::nanoseconds Quantile(double q) const {
+        auto rank = static_cast<uint64_t>(q * static_cast<double>(count_));
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < kBuckets; ++bucket) {
+            seen += buckets_[bucket];
+            if (seen > rank || seen == count_) {
+                return std::chrono::nanoseconds(
+                    std::min(max_ns_, (uint64_t{1} << bucket) - 1));
+            }
+        }
+        return Max();
+    }
+
+    [[nodiscard]] const std::array<uint64_t, kBuckets> &Buckets() const {
+        return buckets_;
+    }
+
+   private:
+    std::array<uint64_t, kBuckets> buckets_{};
+    uint64_t count_ = 0;
+    uint64_t total_ns_ = 0;
+    uint64_t max_ns_ = 0;
+};
+
+}  // namespace avl_tree
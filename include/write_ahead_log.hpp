@@ -0,0 +1,258 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "snapshot.hpp"
+
+namespace avl_tree {
+
+// When appended records reach the disk. A crash loses at most the records
+// of one unfinished group.
+struct DurabilityOptions final {
+    // records written and synced together, 1 syncs every record
+    size_t group_size = 1;
+    // also commit a group once it is this old; zero leaves it to group_size
+    // alone. Only checked on Append, so this is not a time bound: a group
+    // whose appends stopped waits for the next Append, Commit (Sync on
+    // DurableAVLTree) or destruction.
+    std::chrono::microseconds interval{0};
+    // false writes the groups but leaves flushing them to the OS
+    bool fsync = true;
+};
+
+// Append-only log of inserted keys, native byte order:
+//   Header (32 bytes)
+//   frames       FrameHeader (16 bytes) followed by record_count keys
+// Every group commit writes one frame with a checksum over its keys, so a
+// frame torn by a crash is recognised and dropped on the next open. Records
+// are numbered from the header's base_sequence on.
+template <typename T>
+class WriteAheadLog final {
+   private:
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "the log stores keys as raw bytes");
+
+    static constexpr char kMagic[8] = {'A', 'V', 'L', 'W',
+                                       'A', 'L', '\0', '\0'};
+    static constexpr uint32_t kFormatVersion = 1;
+
+    struct Header final {
+        char magic[8];
+        uint32_t format_version;
+        uint32_t key_size;
+        uint64_t base_sequence;
+        uint64_t reserved;
+    };
+    static_assert(sizeof(Header) == 32);
+
+    struct FrameHeader final {
+        uint32_t record_count;
+        uint32_t reserved;
+        uint64_t checksum;
+    };
+    static_assert(sizeof(FrameHeader) == 16);
+
+    static uint64_t FrameChecksum(uint32_t record_count,
+                                  std::span<const T> keys) {
+        uint64_t hash = snapshot::Checksum(&record_count, sizeof(record_count),
+                                           0x9e3779b97f4a7c15ULL);
+        return snapshot::Checksum(keys.data(), keys.size_bytes(), hash);
+    }
+
+    std::string path_;
+    DurabilityOptions options_;
+    int fd_ = -1;
+    uint64_t base_sequence_ = 0;
+    uint64_t next_sequence_ = 0;
+    std::vector<T> pending_;
+    std::vector<std::byte> frame_;
+    std::chrono::steady_clock::time_point group_start_;
+
+    // reads the records of the log at path into replay (if given), returns
+    // the size of the intact prefix; throws if the header is not ours
+    size_t Scan(std::vector<T> *replay) {
+        int fd = open(path_.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "\n Failed to open write-ahead log");
+        }
+        std::vector<std::byte> data;
+        struct stat info;
+        if (fstat(fd, &info) == 0) {
+            data.resize(static_cast<size_t>(info.st_size));
+        }
+        size_t got = 0;
+        while (got < data.size()) {
+            ssize_t chunk = read(fd, data.data() + got, data.size() - got);
+            if (chunk < 0 && errno == EINTR) continue;
+            if (chunk <= 0) break;
+            got += static_cast<size_t>(chunk);
+        }
+        close(fd);
+        data.resize(got);
+
+        Header header;
+        if (data.size() < sizeof(header)) throw LogFormatException();
+        std::memcpy(&header, data.data(), sizeof(header));
+        if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+            header.format_version != kFormatVersion ||
+            header.key_size != sizeof(T)) {
+            throw LogFormatException();
+        }
+        base_sequence_ = next_sequence_ = header.base_sequence;
+
+        size_t offset = sizeof(header);
+        std::vector<T> keys;
+        while (data.size() - offset >= sizeof(FrameHeader)) {
+            FrameHeader frame;
+            std::memcpy(&frame, data.data() + offset, sizeof(frame));
+            size_t bytes = size_t{frame.record_count} * sizeof(T);
+            if (data.size() - offset - sizeof(frame) < bytes) break;
+
+            keys.resize(frame.record_count);
+            std::memcpy(keys.data(), data.data() + offset + sizeof(frame),
+                        bytes);
+            if (FrameChecksum(frame.record_count, keys) != frame.checksum) {
+                break;
+            }
+            if (replay) replay->insert(replay->end(), keys.begin(), keys.end());
+            next_sequence_ += frame.record_count;
+            offset += sizeof(frame) + bytes;
+        }
+        return offset;
+    }
+
+    void WriteFrame() {
+        if (pending_.empty()) return;
+
+        FrameHeader frame{};
+        frame.record_count = static_cast<uint32_t>(pending_.size());
+        frame.checksum = FrameChecksum(frame.record_count, pending_);
+        frame_.resize(sizeof(frame) + pending_.size() * sizeof(T));
+        std::memcpy(frame_.data(), &frame, sizeof(frame));
+        std::memcpy(frame_.data() + sizeof(frame), pending_.data(),
+                    pending_.size() * sizeof(T));
+        snapshot::WriteAll(fd_, frame_.data(), frame_.size());
+        next_sequence_ += pending_.size();
+        pending_.clear();
+    }
+
+   public:
+    // Replaces path with an empty log whose first record will be numbered
+    // base_sequence, returns once the new log is on disk
+    static void Reset(const std::string &path, uint64_t base_sequence) {
+        Header header{};
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.format_version = kFormatVersion;
+        header.key_size = sizeof(T);
+        header.base_sequence = base_sequence;
+
+        std::string temp_path = path + ".tmp";
+        int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "\n Failed to create write-ahead log");
+        }
+        try {
+            snapshot::WriteAll(fd, &header, sizeof(header));
+            if (fsync(fd) != 0) {
+                throw std::system_error(errno, std::generic_category(),
+                                        "\n Failed to sync write-ahead log");
+            }
+        } catch (...) {
+            close(fd);
+            unlink(temp_path.c_str());
+            throw;
+        }
+        close(fd);
+        if (rename(temp_path.c_str(), path.c_str()) != 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "\n Failed to replace write-ahead log");
+        }
+        snapshot::SyncParentDirectory(path);
+    }
+
+    // Opens the log at path for appending, creating it if missing. Records
+    // already in the log go to replay in log order, a torn last frame is cut
+    // off. Throws LogFormatException for a file that is not a log of T.
+    WriteAheadLog(std::string path, DurabilityOptions options,
+                  std::vector<T> *replay = nullptr)
+        : path_(std::move(path)), options_(options) {
+        if (access(path_.c_str(), F_OK) != 0) {
+            Reset(path_, 0);
+        }
+        size_t intact = Scan(replay);
+
+        fd_ = open(path_.c_str(), O_WRONLY | O_APPEND);
+        if (fd_ < 0 || ftruncate(fd_, static_cast<off_t>(intact)) != 0) {
+            int error = errno;
+            if (fd_ >= 0) close(fd_);
+            throw std::system_error(error, std::generic_category(),
+                                    "\n Failed to open write-ahead log");
+        }
+    }
+
+    // commits what is still pending, errors are lost here: call Commit
+    // first to see them
+    ~WriteAheadLog() {
+        try {
+            Commit();
+        } catch (...) {
+        }
+        close(fd_);
+    }
+
+    WriteAheadLog(const WriteAheadLog &) = delete;
+    WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+    void Append(const T &key) {
+        if (pending_.empty()) {
+            group_start_ = std::chrono::steady_clock::now();
+        }
+        pending_.push_back(key);
+        if (pending_.size() >= options_.group_size ||
+            (options_.interval.count() > 0 &&
+             std::chrono::steady_clock::now() - group_start_ >=
+                 options_.interval)) {
+            Commit();
+        }
+    }
+
+    // writes the pending group and syncs it (unless fsync is off)
+    void Commit() {
+        if (pending_.empty()) return;
+
+        WriteFrame();
+        if (options_.fsync && fdatasync(fd_) != 0) {
+            throw std::system_error(errno, std::generic_category(),
+                                    "\n Failed to sync write-ahead log");
+        }
+    }
+
+    // number of the first record in this log file
+    [[nodiscard]] uint64_t BaseSequence() const { return base_sequence_; }
+
+    // number the next appended record gets
+    [[nodiscard]] uint64_t NextSequence() const {
+        return next_sequence_ + pending_.size();
+    }
+
+    // records appended but not committed yet
+    [[nodiscard]] size_t Pending() const { return pending_.size(); }
+};
+
+}  // namespace avl_tree
@@ -1,59 +1,633 @@
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 #include "avl_tree.hpp"
+#include "bplus_tree.hpp"
+#include "cached_avl_tree.hpp"
+#include "fast_io.hpp"
+#include "offline_range_counter.hpp"
+#include "pipelined_io.hpp"
+#include "range_index.hpp"
+#include "snapshot.hpp"
+#include "sorted_buffer_index.hpp"
+#include "thread_pool.hpp"
 #include "tree_exceptions.hpp"
+#include "tree_stats.hpp"
 
-int main(int argc, char *argv[]) {
-    google::InitGoogleLogging(argv[0]);
-    FLAGS_logtostderr = 1;
-    FLAGS_minloglevel = google::FATAL;
-    avl_tree::AVLTree<int> tree;
+namespace {
+
+enum class Engine { kAVLTree, kBPlusTree, kSortedBuffer };
+
+enum class StatsFormat { kNone, kText, kJson };
+
+struct Options final {
+    size_t threads = 1;
+    std::string snapshot;  // empty: no snapshot
+    bool offline = false;
+    bool pipeline = false;
+    Engine engine = Engine::kAVLTree;
+    StatsFormat stats = StatsFormat::kNone;
+    size_t cache = 0;  // entries of the query cache, 0: no cache
+};
+
+void PrintUsage(const char *program) {
+    std::cerr << "Usage: " << program
+              << " [--threads N] [--snapshot PATH] [--offline] [--pipeline]"
+                 " [--engine E] [--stats F] [--cache N]\n"
+              << "  --threads N      answer runs of queries on N threads "
+                 "(0 = all cores)\n"
+              << "  --snapshot PATH  start from the keys saved in PATH if it "
+                 "exists, save all keys there at exit\n"
+              << "  --offline        read the whole input before answering, "
+                 "for batch jobs\n"
+              << "  --pipeline       parse input and write output on threads "
+                 "of their own\n"
+              << "  --engine E       index the keys with avl (default), "
+                 "btree or sorted\n"
+              << "  --stats F        time every command and report latencies "
+                 "and tree counters on stderr as text or json\n"
+              << "  --cache N        answer repeated query windows from a "
+                 "cache of N entries (avl engine, online only)"
+              << std::endl;
+}
+
+// whole of value as a number, false if it is not one
+bool ParseNumber(std::string_view value, size_t &number) {
+    auto [ptr, ec] =
+        std::from_chars(value.data(), value.data() + value.size(), number);
+    return ec == std::errc() && ptr == value.data() + value.size();
+}
+
+std::optional<Options> ParseOptions(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            if (!ParseNumber(argv[++i], options.threads)) return std::nullopt;
+        } else if (arg == "--snapshot" && i + 1 < argc) {
+            options.snapshot = argv[++i];
+        } else if (arg == "--offline") {
+            options.offline = true;
+        } else if (arg == "--pipeline") {
+            options.pipeline = true;
+        } else if (arg == "--engine" && i + 1 < argc) {
+            std::string_view value = argv[++i];
+            if (value == "avl") {
+                options.engine = Engine::kAVLTree;
+            } else if (value == "btree") {
+                options.engine = Engine::kBPlusTree;
+            } else if (value == "sorted") {
+                options.engine = Engine::kSortedBuffer;
+            } else {
+                return std::nullopt;
+            }
+        } else if (arg == "--stats" && i + 1 < argc) {
+            std::string_view value = argv[++i];
+            if (value == "text") {
+                options.stats = StatsFormat::kText;
+            } else if (value == "json") {
+                options.stats = StatsFormat::kJson;
+            } else {
+                return std::nullopt;
+            }
+        } else if (arg == "--cache" && i + 1 < argc) {
+            if (!ParseNumber(argv[++i], options.cache)) return std::nullopt;
+        } else {
+            return std::nullopt;
+        }
+    }
+
+    if (options.cache != 0 &&
+        (options.offline || options.engine != Engine::kAVLTree)) {
+        return std::nullopt;
+    }
+    if (options.threads == 0) {
+        options.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return options;
+}
+
+// --stats: latency of every command, and the engine's counters if it
+// keeps any (AVLTree, see tree_stats.hpp, and the --cache hit rates)
+struct RunStats final {
+    avl_tree::LatencyHistogram inserts;
+    avl_tree::LatencyHistogram queries;
+    std::optional<avl_tree::TreeCounters> tree;
+    std::optional<avl_tree::CacheCounters> cache;
+};
+
+// runs op and records how long it took
+template <typename Op>
+void Timed(avl_tree::LatencyHistogram &histogram, Op op) {
+    auto start = std::chrono::steady_clock::now();
+    op();
+    histogram.Record(std::chrono::steady_clock::now() - start);
+}
+
+void PrintHistogramText(std::string_view name,
+                        const avl_tree::LatencyHistogram &histogram) {
+    std::cerr << name << ": " << histogram.Count() << " commands, mean "
+              << histogram.Mean().count() << " ns, p50 <= "
+              << histogram.Quantile(0.5).count() << " ns, p99 <= "
+              << histogram.Quantile(0.99).count() << " ns, p99.9 <= "
+              << histogram.Quantile(0.999).count() << " ns, max "
+              << histogram.Max().count() << " ns\n";
+    const auto &buckets = histogram.Buckets();
+    for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+        if (buckets[bucket] == 0) continue;
+        uint64_t low = bucket == 0 ? 0 : uint64_t{1} << (bucket - 1);
+        std::cerr << "  [" << low << ", " << (uint64_t{1} << bucket)
+                  << ") ns: " << buckets[bucket] << "\n";
+    }
+}
+
+void PrintHistogramJson(std::string_view name,
+                        const avl_tree::LatencyHistogram &histogram) {
+    std::cerr << '"' << name << "\":{\"count\":" << histogram.Count()
+              << ",\"mean_ns\":" << histogram.Mean().count()
+              << ",\"p50_ns\":" << histogram.Quantile(0.5).count()
+              << ",\"p99_ns\":" << histogram.Quantile(0.99).count()
+              << ",\"p999_ns\":" << histogram.Quantile(0.999).count()
+              << ",\"max_ns\":" << histogram.Max().count()
+              << ",\"buckets\":[";
+    const auto &buckets = histogram.Buckets();
+    for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+        std::cerr << (bucket ? "," : "") << buckets[bucket];
+    }
+    std::cerr << "]}";
+}
+
+// Bucket b of a histogram counts latencies in [2^(b-1), 2^b) ns. Tree
+// counters other than height and node bytes read 0 unless the tree was
+// built with AVL_TREE_STATS.
+void PrintStats(StatsFormat format, const RunStats &stats) {
+    const std::optional<avl_tree::TreeCounters> &tree = stats.tree;
+    const std::optional<avl_tree::CacheCounters> &cache = stats.cache;
+    if (format == StatsFormat::kText) {
+        PrintHistogramText("inserts", stats.inserts);
+        PrintHistogramText("queries", stats.queries);
+        if (tree) {
+            std::cerr << "tree: max height " << tree->max_height << ", "
+                      << tree->node_bytes << " node bytes\n";
+            if (avl_tree::kStatsEnabled) {
+                std::cerr << "  rotations: " << tree->left_rotations
+                          << " left, " << tree->right_rotations << " right\n"
+                          << "  comparisons: " << tree->comparisons << "\n"
+                          << "  range queries: " << tree->range_queries
+                          << ", nodes visited: " << tree->nodes_visited
+                          << "\n"
+                          << "  duplicate inserts: "
+                          << tree->duplicate_inserts << "\n";
+            } else {
+                std::cerr << "  event counters not built in, configure "
+                             "with -DSTATS=ON\n";
+            }
+        }
+        if (cache) {
+            std::cerr << "cache: " << cache->hits << " hits ("
+                      << cache->patched << " patched), " << cache->misses
+                      << " misses, " << cache->evictions << " evictions, "
+                      << cache->entries << " entries\n";
+        }
+        std::cerr << std::flush;
+        return;
+    }
+
+    std::cerr << '{';
+    PrintHistogramJson("inserts", stats.inserts);
+    std::cerr << ',';
+    PrintHistogramJson("queries", stats.queries);
+    if (tree) {
+        std::cerr << ",\"tree\":{\"counters\":"
+                  << (avl_tree::kStatsEnabled ? "true" : "false")
+                  << ",\"max_height\":" << tree->max_height
+                  << ",\"node_bytes\":" << tree->node_bytes
+                  << ",\"left_rotations\":" << tree->left_rotations
+                  << ",\"right_rotations\":" << tree->right_rotations
+                  << ",\"comparisons\":" << tree->comparisons
+                  << ",\"range_queries\":" << tree->range_queries
+                  << ",\"nodes_visited\":" << tree->nodes_visited
+                  << ",\"duplicate_inserts\":" << tree->duplicate_inserts
+                  << '}';
+    }
+    if (cache) {
+        std::cerr << ",\"cache\":{\"hits\":" << cache->hits
+                  << ",\"patched\":" << cache->patched
+                  << ",\"misses\":" << cache->misses
+                  << ",\"evictions\":" << cache->evictions
+                  << ",\"entries\":" << cache->entries << '}';
+    }
+    std::cerr << '}' << std::endl;
+}
+
+// Sorts items by their high 32 bits, three stable counting passes of 11
+// bits. About three times faster than std::sort on the millions of tagged
+// numbers of a batch input.
+void RadixSortByHighHalf(std::vector<uint64_t> &items) {
+    constexpr unsigned kDigitBits = 11;
+    constexpr size_t kBuckets = size_t{1} << kDigitBits;
+    constexpr unsigned kShifts[] = {32, 32 + kDigitBits, 32 + 2 * kDigitBits};
+
+    std::array<std::array<size_t, kBuckets>, 3> starts{};
+    for (uint64_t item : items) {
+        for (size_t pass = 0; pass < 3; ++pass) {
+            ++starts[pass][(item >> kShifts[pass]) & (kBuckets - 1)];
+        }
+    }
+
+    std::vector<uint64_t> scratch(items.size());
+    for (size_t pass = 0; pass < 3; ++pass) {
+        size_t offset = 0;
+        for (size_t &start : starts[pass]) {
+            offset += std::exchange(start, offset);
+        }
+        for (uint64_t item : items) {
+            size_t digit = (item >> kShifts[pass]) & (kBuckets - 1);
+            scratch[starts[pass][digit]++] = item;
+        }
+        items.swap(scratch);
+    }
+}
+
+// Replaces every number in commands by an index among the distinct keys of
+// the k commands and base_keys: a key by its own index, a query by the
+// number of keys below min and the number not above max. One sort of all
+// numbers stands in for a search per command. Returns the distinct keys in
+// ascending order, base_indices gets the indices of base_keys.
+std::vector<int> CompressCommands(std::vector<range_queries::Command> &commands,
+                                  std::span<const int> base_keys,
+                                  std::vector<uint32_t> &base_indices) {
+    enum Kind : uint64_t { kKey, kMin, kMax, kBaseKey };
+    if (commands.size() >= (size_t{1} << 30)) {
+        throw avl_tree::CapacityExceededException();
+    }
+
+    // the number with its sign bit flipped in the high half, so unsigned
+    // order is numeric order, and command index and kind in the low half
+    auto tag = [](int number, uint64_t slot) {
+        return uint64_t{static_cast<uint32_t>(number) ^ 0x80000000u} << 32 |
+               slot;
+    };
+    std::vector<uint64_t> numbers;
+    numbers.reserve(commands.size() * 2 + base_keys.size());
+    for (size_t i = 0; i < commands.size(); ++i) {
+        const range_queries::Command &command = commands[i];
+        if (command.type == 'k') {
+            numbers.push_back(tag(command.first, i << 2 | kKey));
+        } else {
+            numbers.push_back(tag(command.first, i << 2 | kMin));
+            numbers.push_back(tag(command.second, i << 2 | kMax));
+        }
+    }
+    for (int key : base_keys) {
+        numbers.push_back(tag(key, kBaseKey));
+    }
+    RadixSortByHighHalf(numbers);
+
+    std::vector<int> universe;
+    for (size_t first = 0, last = 0; first < numbers.size(); first = last) {
+        uint64_t number = numbers[first] >> 32;
+        bool is_key = false;
+        for (; last < numbers.size() && numbers[last] >> 32 == number; ++last) {
+            Kind kind = static_cast<Kind>(numbers[last] & 3);
+            is_key |= kind == kKey || kind == kBaseKey;
+        }
 
-    char command;
+        int index = static_cast<int>(universe.size());
+        for (size_t i = first; i < last; ++i) {
+            // base keys carry no command index
+            size_t slot = (numbers[i] >> 2) & (UINT32_MAX >> 2);
+            switch (static_cast<Kind>(numbers[i] & 3)) {
+                case kKey:
+                case kMin:
+                    commands[slot].first = index;
+                    break;
+                case kMax:
+                    commands[slot].second = index + is_key;
+                    break;
+                case kBaseKey:
+                    base_indices.push_back(static_cast<uint32_t>(index));
+                    break;
+            }
+        }
+        if (is_key) {
+            universe.push_back(static_cast<int>(number ^ 0x80000000u));
+        }
+    }
+    return universe;
+}
+
+// --offline: the whole input is read first, so every key that will be
+// inserted is known. The commands are coordinate-compressed and replayed
+// against an OfflineRangeCounter, each one a bit flip or two prefix sums
+// over cache-resident arrays. The output is the one the online mode
+// writes, malformed input included.
+void RunOffline(const Options &options,
+                std::optional<avl_tree::MappedSnapshot<int>> &base) {
+    std::vector<range_queries::Command> commands;
+    std::optional<std::string> input_error;
+    try {
+        range_queries::CommandReader input;
+        range_queries::Command command;
+        while (input.Next(command)) {
+            commands.push_back(command);
+        }
+    } catch (const std::invalid_argument &e) {
+        // commands read before the bad token are still answered
+        input_error = e.what();
+    }
 
+    std::vector<uint32_t> base_indices;
+    std::optional<avl_tree::OfflineRangeCounter<int>> counter;
     try {
-        while (std::cin >> command) {
-            switch (command) {
-                case 'k': {
-                    int n;
-                    std::cin >> n;
-                    if (!std::cin.good()) {
-                        throw std::invalid_argument("\n Key invalid");
+        std::vector<int> universe =
+            CompressCommands(commands,
+                             base ? base->Keys() : std::span<const int>(),
+                             base_indices);
+        base.reset();
+        counter.emplace(universe.begin(), universe.end());
+    } catch (const avl_tree::AVLException &e) {
+        // too many commands or keys, nothing has been answered yet
+        std::cerr << "Tree error: " << e.what() << std::endl;
+        return;
+    }
+    for (uint32_t index : base_indices) {
+        counter->InsertAt(index);
+    }
+
+    std::optional<RunStats> stats;
+    if (options.stats != StatsFormat::kNone) stats.emplace();
+
+    range_queries::OutputWriter output;
+    for (const range_queries::Command &command : commands) {
+        if (command.type == 'k') {
+            auto insert = [&] {
+                counter->InsertAt(static_cast<size_t>(command.first));
+            };
+            if (stats) {
+                Timed(stats->inserts, insert);
+            } else {
+                insert();
+            }
+            continue;
+        }
+        // min > max leaves the upper index at or below the lower one
+        auto lower = static_cast<size_t>(command.first);
+        auto upper = static_cast<size_t>(command.second);
+        size_t count = 0;
+        auto query = [&] {
+            if (upper > lower) {
+                count =
+                    counter->CountBefore(upper) - counter->CountBefore(lower);
+            }
+        };
+        if (stats) {
+            Timed(stats->queries, query);
+        } else {
+            query();
+        }
+        output.WriteCount(count);
+    }
+    if (!input_error) output.WriteChar('\n');
+    output.Flush();
+    if (input_error) {
+        std::cerr << "Input error: " << *input_error << std::endl;
+    }
+
+    if (!options.snapshot.empty()) {
+        try {
+            std::vector<int> keys = counter->Keys();
+            avl_tree::snapshot::Write<int>(options.snapshot, keys, {}, false,
+                                           0);
+        } catch (const std::exception &e) {
+            std::cerr << "Snapshot error: " << e.what() << std::endl;
+        }
+    }
+    if (stats) PrintStats(options.stats, *stats);
+}
+
+// Answers the commands from input as they come, keys go to an Index engine
+// (see RangeIndex). Input is a CommandReader or PipelinedIo, output an
+// OutputWriter or the same PipelinedIo.
+template <typename Index, typename Input, typename Output>
+void RunOnline(const Options &options,
+               std::optional<avl_tree::MappedSnapshot<int>> &base,
+               Input &input, Output &output) {
+    Index tree = [&] {
+        if constexpr (std::is_same_v<Index, avl_tree::CachedAVLTree<int>>) {
+            return Index(options.cache);
+        } else {
+            return Index();
+        }
+    }();
+    // runs of 'k' are applied in one batch right before the next query
+    std::vector<int> pending_keys;
+    // runs of 'q' are answered together, possibly on several threads
+    constexpr size_t kMaxPendingQueries = size_t{1} << 16;
+    std::vector<std::pair<int, int>> pending_queries;
+    std::vector<size_t> results;
+
+    std::optional<avl_tree::ThreadPool> pool;
+    if (options.threads > 1) {
+        pool.emplace(options.threads);
+    }
+    // with --stats every command runs on its own on this thread, so each
+    // latency sample is one command
+    std::optional<RunStats> stats;
+    if (options.stats != StatsFormat::kNone) stats.emplace();
+
+    auto apply_keys = [&] {
+        if (pending_keys.empty()) return;
+
+        if (stats) {
+            for (int key : pending_keys) {
+                Timed(stats->inserts, [&] {
+                    if (!base || base->RangeQuery(key, key) == 0) {
+                        tree.Insert(key);
                     }
+                });
+            }
+            pending_keys.clear();
+            return;
+        }
+        if (base) {
+            std::erase_if(pending_keys, [&](int key) {
+                return base->RangeQuery(key, key) != 0;
+            });
+        }
+        avl_tree::InsertAll<int>(tree, pending_keys.begin(),
+                                 pending_keys.end());
+        pending_keys.clear();
+    };
 
-                    tree.Insert(n);
-                    break;
+    auto answer_queries = [&] {
+        if (pending_queries.empty()) return;
+
+        results.resize(pending_queries.size());
+        if (stats) {
+            for (size_t i = 0; i < results.size(); ++i) {
+                auto [min, max] = pending_queries[i];
+                Timed(stats->queries, [&] {
+                    results[i] = tree.RangeQuery(min, max) +
+                                 (base ? base->RangeQuery(min, max) : 0);
+                });
+            }
+        } else {
+            avl_tree::RangeQueryBatch<int>(tree, pending_queries, results,
+                                           pool ? &*pool : nullptr);
+            if (base) {
+                for (size_t i = 0; i < results.size(); ++i) {
+                    results[i] += base->RangeQuery(pending_queries[i].first,
+                                                   pending_queries[i].second);
                 }
-                case 'q': {
-                    int a;
-                    std::cin >> a;
-                    if (!std::cin.good()) {
-                        throw std::invalid_argument(
-                            "\n Invalid first number for the request");
-                    }
+            }
+        }
+        for (size_t count : results) {
+            output.WriteCount(count);
+        }
+        pending_queries.clear();
+    };
 
-                    int b;
-                    std::cin >> b;
-                    if (!std::cin.good()) {
-                        throw std::invalid_argument(
-                            "\n Invalid second number for the request");
+    try {
+        range_queries::Command command;
+        while (input.Next(command)) {
+            switch (command.type) {
+                case 'k':
+                    answer_queries();
+                    pending_keys.push_back(command.first);
+                    break;
+                case 'q':
+                    apply_keys();
+                    pending_queries.emplace_back(command.first,
+                                                 command.second);
+                    if (pending_queries.size() == kMaxPendingQueries) {
+                        answer_queries();
                     }
-
-                    std::cout << tree.RangeQuery(a, b) << " ";
                     break;
-                }
-                default:
-                    throw std::invalid_argument("\n Unknown command");
             }
         }
-        std::cout << std::endl;
+        answer_queries();
+        output.WriteChar('\n');
+        output.Flush();
     } catch (const avl_tree::AVLException &e) {
+        output.Flush();
         std::cerr << "Tree error: " << e.what() << std::endl;
     } catch (const std::invalid_argument &e) {
+        // queries read before the bad token are still answered
+        answer_queries();
+        output.Flush();
         std::cerr << "Input error: " << e.what() << std::endl;
     } catch (...) {
+        output.Flush();
         std::cerr << "Don't know this exception" << std::endl;
     }
 
+    if (!options.snapshot.empty()) {
+        try {
+            apply_keys();
+            if (base) {
+                avl_tree::InsertAll<int>(tree, base->Keys().begin(),
+                                         base->Keys().end());
+                base.reset();
+            }
+            std::vector<int> keys = avl_tree::SortedKeys<int>(tree);
+            avl_tree::snapshot::Write<int>(options.snapshot, keys, {}, false,
+                                           0);
+        } catch (const std::exception &e) {
+            std::cerr << "Snapshot error: " << e.what() << std::endl;
+        }
+    }
+    if (stats) {
+        if constexpr (requires { tree.Counters(); }) {
+            stats->tree = tree.Counters();
+        }
+        if constexpr (requires { tree.CacheStats(); }) {
+            stats->cache = tree.CacheStats();
+        }
+        PrintStats(options.stats, *stats);
+    }
+}
+
+template <typename Input, typename Output>
+void RunOnlineWith(const Options &options,
+                   std::optional<avl_tree::MappedSnapshot<int>> &base,
+                   Input &input, Output &output) {
+    switch (options.engine) {
+        case Engine::kAVLTree:
+            if (options.cache != 0) {
+                RunOnline<avl_tree::CachedAVLTree<int>>(options, base, input,
+                                                        output);
+            } else {
+                RunOnline<avl_tree::AVLTree<int>>(options, base, input,
+                                                  output);
+            }
+            break;
+        case Engine::kBPlusTree:
+            RunOnline<avl_tree::BPlusTree<int>>(options, base, input, output);
+            break;
+        case Engine::kSortedBuffer:
+            RunOnline<avl_tree::SortedBufferIndex<int>>(options, base, input,
+                                                        output);
+            break;
+    }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_logtostderr = 1;
+    FLAGS_minloglevel = google::FATAL;
+
+    std::optional<Options> options = ParseOptions(argc, argv);
+    if (!options) {
+        PrintUsage(argv[0]);
+        google::ShutdownGoogleLogging();
+        return 1;
+    }
+
+    // keys of the snapshot stay in the mapped file, the engine holds only
+    // the keys read since; answers add both up
+    std::optional<avl_tree::MappedSnapshot<int>> base;
+    if (!options->snapshot.empty() &&
+        std::filesystem::exists(options->snapshot)) {
+        try {
+            base.emplace(options->snapshot);
+        } catch (const std::exception &e) {
+            std::cerr << "Snapshot error: " << e.what() << std::endl;
+            google::ShutdownGoogleLogging();
+            return 1;
+        }
+    }
+    if (options->offline) {
+        RunOffline(*options, base);
+        google::ShutdownGoogleLogging();
+        return 0;
+    }
+
+    if (options->pipeline) {
+        range_queries::PipelinedIo io;
+        RunOnlineWith(*options, base, io, io);
+    } else {
+        range_queries::CommandReader input;
+        range_queries::OutputWriter output;
+        RunOnlineWith(*options, base, input, output);
+    }
+
     google::ShutdownGoogleLogging();
 
     return 0;
-}
\ No newline at end of file
+}
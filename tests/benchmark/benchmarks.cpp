@@ -0,0 +1,387 @@
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "avl_tree.hpp"
+#include "bplus_tree.hpp"
+#include "cached_avl_tree.hpp"
+#include "durable_avl_tree.hpp"
+#include "fast_io.hpp"
+#include "sharded_avl_tree.hpp"
+#include "sorted_buffer_index.hpp"
+
+namespace {
+
+using Tree = avl_tree::AVLTree<int>;
+
+std::vector<int> RandomKeys(size_t count, int max_key, unsigned seed) {
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> dist(0, max_key);
+    std::vector<int> keys(count);
+    for (int &key : keys) {
+        key = dist(gen);
+    }
+    return keys;
+}
+
+Tree BuildTree(size_t size) {
+    std::vector<int> keys(size);
+    for (size_t i = 0; i < size; ++i) {
+        keys[i] = static_cast<int>(i * 2);
+    }
+    return Tree::FromRange(keys.begin(), keys.end());
+}
+
+void BM_InsertSequential(benchmark::State &state) {
+    const auto size = static_cast<int>(state.range(0));
+    for (auto _ : state) {
+        Tree tree;
+        for (int key = 0; key < size; ++key) {
+            tree.Insert(key);
+        }
+        benchmark::DoNotOptimize(tree.Size());
+    }
+    state.SetItemsProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_InsertSequential)->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+
+void BM_InsertRandom(benchmark::State &state) {
+    const auto keys = RandomKeys(state.range(0), 1 << 30, 1);
+    for (auto _ : state) {
+        Tree tree;
+        for (int key : keys) {
+            tree.Insert(key);
+        }
+        benchmark::DoNotOptimize(tree.Size());
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_InsertRandom)->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+
+// about 16 inserts per distinct key
+void BM_InsertDuplicateHeavy(benchmark::State &state) {
+    const auto keys =
+        RandomKeys(state.range(0), static_cast<int>(state.range(0) / 16), 2);
+    for (auto _ : state) {
+        Tree tree;
+        for (int key : keys) {
+            tree.Insert(key);
+        }
+        benchmark::DoNotOptimize(tree.Size());
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_InsertDuplicateHeavy)
+    ->RangeMultiplier(16)
+    ->Range(1 << 10, 1 << 20);
+
+// state.range(1) is the window width in keys
+void BM_RangeQuery(benchmark::State &state) {
+    const auto size = static_cast<size_t>(state.range(0));
+    const auto width = static_cast<int>(state.range(1));
+    const Tree tree = BuildTree(size);
+    const auto bounds = RandomKeys(4096, static_cast<int>(size * 2), 3);
+
+    size_t i = 0;
+    for (auto _ : state) {
+        int min = bounds[i++ & 4095];
+        benchmark::DoNotOptimize(tree.RangeQuery(min, min + width * 2));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RangeQuery)
+    ->ArgNames({"size", "width"})
+    ->ArgsProduct({{1 << 10, 1 << 16, 1 << 20}, {16, 1 << 20}});
+
+void BM_IterateInOrder(benchmark::State &state) {
+    const Tree tree = BuildTree(state.range(0));
+    for (auto _ : state) {
+        int64_t sum = 0;
+        for (auto it = tree.BeginInOrder(); it != tree.EndInOrder(); ++it) {
+            sum += *it;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_IterateInOrder)->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+
+void BM_IteratePreOrder(benchmark::State &state) {
+    const Tree tree = BuildTree(state.range(0));
+    for (auto _ : state) {
+        int64_t sum = 0;
+        for (auto it = tree.BeginPreOrder(); it != tree.EndPreOrder(); ++it) {
+            sum += *it;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_IteratePreOrder)->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+
+// only the destruction of the tree is timed
+void BM_Clear(benchmark::State &state) {
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto tree = std::make_unique<Tree>(BuildTree(state.range(0)));
+        state.ResumeTiming();
+        tree.reset();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Clear)->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+
+// mixed k/q load, one insert per four queries, from state.threads() threads
+// sharing one tree
+void BM_ShardedMixed(benchmark::State &state) {
+    static std::unique_ptr<avl_tree::ShardedAVLTree<int>> tree;
+    if (state.thread_index() == 0) {
+        tree = std::make_unique<avl_tree::ShardedAVLTree<int>>(
+            static_cast<size_t>(state.threads()));
+        for (int key : RandomKeys(1 << 16, 1 << 30, 4)) {
+            tree->Insert(key);
+        }
+    }
+
+    std::mt19937 gen(static_cast<unsigned>(state.thread_index()));
+    size_t i = 0;
+    for (auto _ : state) {
+        int key = static_cast<int>(gen() >> 2);
+        if (i++ % 5 == 0) {
+            tree->Insert(key);
+        } else {
+            benchmark::DoNotOptimize(tree->RangeQuery(key, key + (1 << 20)));
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ShardedMixed)->ThreadRange(1, 8)->UseRealTime();
+
+// Inserts through the write-ahead log, args are the group size, the group
+// interval in microseconds (0: none) and whether groups are fsync-ed.
+// Compare with BM_InsertRandom for the cost of durability.
+void BM_DurableInsert(benchmark::State &state) {
+    const std::string base =
+        (std::filesystem::temp_directory_path() / "avl_bench_durable")
+            .string();
+    std::remove((base + ".wal").c_str());
+    std::remove((base + ".snapshot").c_str());
+    avl_tree::DurabilityOptions options{
+        .group_size = static_cast<size_t>(state.range(0)),
+        .interval = std::chrono::microseconds(state.range(1)),
+        .fsync = state.range(2) != 0};
+
+    {
+        avl_tree::DurableAVLTree<int> tree(base, options);
+        std::mt19937 gen(5);
+        for (auto _ : state) {
+            tree.Insert(static_cast<int>(gen() >> 1));
+        }
+        tree.Sync();
+    }
+    state.SetItemsProcessed(state.iterations());
+    std::remove((base + ".wal").c_str());
+}
+BENCHMARK(BM_DurableInsert)
+    ->ArgNames({"group", "interval_us", "fsync"})
+    ->Args({1, 0, 1})
+    ->Args({64, 0, 1})
+    ->Args({4096, 0, 1})
+    ->Args({1 << 30, 1000, 1})
+    ->Args({1 << 30, 10000, 1})
+    ->Args({4096, 0, 0})
+    ->UseRealTime();
+
+// range sums from the augmented tree against a scan of the in-order keys,
+// state.range(1) is the window width in keys
+template <bool kAugmented>
+void BM_RangeSum(benchmark::State &state) {
+    using SumTree =
+        avl_tree::AugmentedAVLTree<int64_t, avl_tree::SumAugmentation<int64_t>>;
+    const auto size = static_cast<size_t>(state.range(0));
+    const auto width = static_cast<int64_t>(state.range(1));
+    std::vector<int64_t> keys(size);
+    for (size_t i = 0; i < size; ++i) {
+        keys[i] = static_cast<int64_t>(i * 2);
+    }
+    const auto tree = SumTree::FromRange(keys.begin(), keys.end());
+    const auto bounds = RandomKeys(4096, static_cast<int>(size * 2), 3);
+
+    size_t i = 0;
+    for (auto _ : state) {
+        int64_t min = bounds[i++ & 4095], max = min + width * 2;
+        if constexpr (kAugmented) {
+            benchmark::DoNotOptimize(tree.RangeAggregate(min, max));
+        } else {
+            int64_t sum = 0;
+            for (auto it = tree.LowerBound(min); it != tree.end() && *it <= max;
+                 ++it) {
+                sum += *it;
+            }
+            benchmark::DoNotOptimize(sum);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RangeSum<true>)
+    ->ArgNames({"size", "width"})
+    ->ArgsProduct({{1 << 16, 1 << 20}, {16, 1 << 16}});
+BENCHMARK(BM_RangeSum<false>)
+    ->ArgNames({"size", "width"})
+    ->ArgsProduct({{1 << 16, 1 << 20}, {16, 1 << 16}});
+
+// state.range(0) random inserts, each followed by state.range(1) range
+// queries, to compare the engines across insert/query ratios
+template <typename Index>
+void BM_EngineMixed(benchmark::State &state) {
+    const auto size = static_cast<size_t>(state.range(0));
+    const auto queries_per_insert = static_cast<size_t>(state.range(1));
+    const auto keys = RandomKeys(size, 1 << 30, 4);
+    const auto bounds = RandomKeys(4096, 1 << 30, 5);
+
+    for (auto _ : state) {
+        Index index;
+        size_t q = 0;
+        for (int key : keys) {
+            index.Insert(key);
+            for (size_t i = 0; i < queries_per_insert; ++i, ++q) {
+                int min = bounds[q & 4095];
+                benchmark::DoNotOptimize(
+                    index.RangeQuery(min, min + (1 << 20)));
+            }
+        }
+        benchmark::DoNotOptimize(index.Size());
+    }
+    state.SetItemsProcessed(state.iterations() * size *
+                            (1 + queries_per_insert));
+}
+BENCHMARK(BM_EngineMixed<Tree>)
+    ->ArgNames({"size", "queries"})
+    ->ArgsProduct({{1 << 16, 1 << 20}, {0, 1, 16}});
+BENCHMARK(BM_EngineMixed<avl_tree::BPlusTree<int>>)
+    ->ArgNames({"size", "queries"})
+    ->ArgsProduct({{1 << 16, 1 << 20}, {0, 1, 16}});
+BENCHMARK(BM_EngineMixed<avl_tree::SortedBufferIndex<int>>)
+    ->ArgNames({"size", "queries"})
+    ->ArgsProduct({{1 << 16, 1 << 20}, {0, 1, 16}});
+
+// range queries one after another against RangeQueryBatch, whose
+// descents run interleaved once the tree outgrows the cache; the tree is
+// built by random inserts so neighbouring keys are not neighbours in memory
+template <bool kBatch>
+void BM_RangeQueryLockstep(benchmark::State &state) {
+    const auto size = static_cast<size_t>(state.range(0));
+    Tree tree;
+    for (int key : RandomKeys(size, 1 << 30, 6)) {
+        tree.Insert(key);
+    }
+    const auto bounds = RandomKeys(8192, 1 << 30, 7);
+    std::vector<std::pair<int, int>> queries(4096);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        queries[i] = std::minmax(bounds[2 * i], bounds[2 * i + 1]);
+    }
+    std::vector<size_t> results(queries.size());
+
+    for (auto _ : state) {
+        if constexpr (kBatch) {
+            tree.RangeQueryBatch(queries, results);
+        } else {
+            for (size_t i = 0; i < queries.size(); ++i) {
+                results[i] =
+                    tree.RangeQuery(queries[i].first, queries[i].second);
+            }
+        }
+        benchmark::DoNotOptimize(results.data());
+    }
+    state.SetItemsProcessed(state.iterations() * queries.size());
+}
+BENCHMARK(BM_RangeQueryLockstep<false>)
+    ->RangeMultiplier(4)
+    ->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_RangeQueryLockstep<true>)
+    ->RangeMultiplier(4)
+    ->Range(1 << 10, 1 << 22);
+
+// 256 hot windows asked over and over, with a new key every
+// state.range(1) queries, through CachedAVLTree or the plain tree
+template <bool kCached>
+void BM_HotWindows(benchmark::State &state) {
+    using Index =
+        std::conditional_t<kCached, avl_tree::CachedAVLTree<int>, Tree>;
+    const auto size = static_cast<size_t>(state.range(0));
+    const auto queries_per_insert = static_cast<size_t>(state.range(1));
+    Index index;
+    for (int key : RandomKeys(size, 1 << 30, 8)) {
+        index.Insert(key);
+    }
+    const auto bounds = RandomKeys(256, 1 << 30, 9);
+    const auto new_keys = RandomKeys(4096, 1 << 30, 10);
+
+    size_t i = 0;
+    for (auto _ : state) {
+        int min = bounds[i & 255];
+        benchmark::DoNotOptimize(index.RangeQuery(min, min + (1 << 24)));
+        if (++i % queries_per_insert == 0) {
+            index.Insert(new_keys[(i / queries_per_insert) & 4095]);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HotWindows<true>)
+    ->ArgNames({"size", "queries"})
+    ->ArgsProduct({{1 << 16, 1 << 20}, {16, 1 << 20}});
+BENCHMARK(BM_HotWindows<false>)
+    ->ArgNames({"size", "queries"})
+    ->ArgsProduct({{1 << 16, 1 << 20}, {16, 1 << 20}});
+
+// whole range_queries pipeline over tests/io_tests/input_tests/test_input<N>
+void BM_ProcessIoTest(benchmark::State &state) {
+    const std::string path = std::string(IO_TESTS_INPUT_DIR) + "/test_input" +
+                             std::to_string(state.range(0)) + ".txt";
+    int64_t commands = 0;
+    for (auto _ : state) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            state.SkipWithError("cannot open io test input");
+            return;
+        }
+
+        Tree tree;
+        std::vector<int> pending_keys;
+        size_t checksum = 0;
+        {
+            range_queries::CommandReader input(fd);
+            range_queries::Command command;
+            while (input.Next(command)) {
+                ++commands;
+                if (command.type == 'k') {
+                    pending_keys.push_back(command.first);
+                    continue;
+                }
+                if (!pending_keys.empty()) {
+                    tree.BulkLoad(pending_keys.begin(), pending_keys.end());
+                    pending_keys.clear();
+                }
+                checksum += tree.RangeQuery(command.first, command.second);
+            }
+        }
+        close(fd);
+        benchmark::DoNotOptimize(checksum);
+    }
+    state.SetItemsProcessed(commands);
+}
+BENCHMARK(BM_ProcessIoTest)->DenseRange(1, 11);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -1,6 +1,12 @@
 #include "avl_tree.hpp"
+#include "bplus_tree.hpp"
+#include "cached_avl_tree.hpp"
+#include "sorted_buffer_index.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <vector>
 
 struct DataProvider {
@@ -25,23 +31,51 @@ struct DataProvider {
     }
 };
 
+// Every engine gets the same commands and has to give the same answers.
+// The small-node B+-tree splits after a handful of keys, so short inputs
+// already reach its inner levels, and the tiny cache keeps evicting.
 extern "C" int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
     DataProvider provider(Data, Size);
     avl_tree::AVLTree<int> tree;
+    avl_tree::BPlusTree<int> btree;
+    avl_tree::BPlusTree<int, 64> small_btree;
+    avl_tree::SortedBufferIndex<int> sorted;
+    avl_tree::CachedAVLTree<int> cached(4);
 
     while (true) {
         char command;
         if (!provider.Read(command)) break;
 
-        if (command % 2 == 0) { 
+        if (command % 2 == 0) {
             int value;
             if (!provider.Read(value)) break;
-            tree.Insert(value);
+            bool inserted = tree.Insert(value);
+            if (btree.Insert(value) != inserted ||
+                small_btree.Insert(value) != inserted ||
+                sorted.Insert(value) != inserted ||
+                cached.Insert(value) != inserted) {
+                abort();
+            }
         } else {
             int a, b;
             if (!provider.Read(a) || !provider.Read(b)) break;
-            tree.RangeQuery(std::min(a, b), std::max(a, b));
+            size_t count = tree.RangeQuery(std::min(a, b), std::max(a, b));
+            if (btree.RangeQuery(std::min(a, b), std::max(a, b)) != count ||
+                small_btree.RangeQuery(std::min(a, b), std::max(a, b)) !=
+                    count ||
+                sorted.RangeQuery(std::min(a, b), std::max(a, b)) != count ||
+                cached.RangeQuery(std::min(a, b), std::max(a, b)) != count) {
+                abort();
+            }
         }
     }
+
+    if (!tree.IsValid() || !btree.IsValid() || !small_btree.IsValid() ||
+        !std::equal(tree.begin(), tree.end(), btree.begin(), btree.end()) ||
+        !std::equal(tree.begin(), tree.end(), small_btree.begin(),
+                    small_btree.end()) ||
+        !std::equal(tree.begin(), tree.end(), sorted.begin(), sorted.end())) {
+        abort();
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,14 +1,60 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
 #include <limits>
+#include <mutex>
+#include <numeric>
+#include <ranges>
+#include <random>
+#include <set>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "avl_tree.hpp"
+#include "bplus_tree.hpp"
+#include "cached_avl_tree.hpp"
+#include "durable_avl_tree.hpp"
+#include "fast_io.hpp"
+#include "offline_range_counter.hpp"
+#include "persistent_avl_tree.hpp"
+#include "pipelined_io.hpp"
+#include "range_index.hpp"
+#include "sharded_avl_tree.hpp"
+#include "snapshot.hpp"
+#include "sorted_buffer_index.hpp"
+#include "spsc_ring.hpp"
+#include "tree_stats.hpp"
 #include "gtest/gtest.h"
 
 namespace avl_tree {
 
-TEST(AVLTreeRangeQueryIntTest, EmptyTree) {
-    AVLTree<int> tree;
+// the int tests run against every engine, so they cross-check each other
+using IntEngines = testing::Types<AVLTree<int>, BPlusTree<int>,
+                                  BPlusTree<int, 64>, SortedBufferIndex<int>>;
+
+static_assert(RangeIndex<AVLTree<int>, int>);
+static_assert(RangeIndex<BPlusTree<int>, int>);
+static_assert(RangeIndex<SortedBufferIndex<int>, int>);
+
+template <typename Index>
+class RangeQueryIntTest : public testing::Test {};
+TYPED_TEST_SUITE(RangeQueryIntTest, IntEngines);
+
+template <typename Index>
+class RangeQueryComplexTest : public testing::Test {};
+TYPED_TEST_SUITE(RangeQueryComplexTest, IntEngines);
+
+TYPED_TEST(RangeQueryIntTest, EmptyTree) {
+    TypeParam tree;
     EXPECT_EQ(tree.RangeQuery(0, 100), 0);
     EXPECT_EQ(tree.RangeQuery(-100, 100), 0);
     EXPECT_EQ(tree.RangeQuery(std::numeric_limits<int>::min(),
@@ -16,8 +62,8 @@ TEST(AVLTreeRangeQueryIntTest, EmptyTree) {
               0);
 }
 
-TEST(AVLTreeRangeQueryIntTest, SingleElementTree) {
-    AVLTree<int> tree;
+TYPED_TEST(RangeQueryIntTest, SingleElementTree) {
+    TypeParam tree;
     tree.Insert(10);
 
     EXPECT_EQ(tree.RangeQuery(0, 5), 0);
@@ -30,8 +76,8 @@ TEST(AVLTreeRangeQueryIntTest, SingleElementTree) {
     EXPECT_EQ(tree.RangeQuery(10, 10), 1);
 }
 
-TEST(AVLTreeRangeQueryIntTest, SimpleTreeThreeNodes) {
-    AVLTree<int> tree;
+TYPED_TEST(RangeQueryIntTest, SimpleTreeThreeNodes) {
+    TypeParam tree;
     tree.Insert(10);
     tree.Insert(5);
     tree.Insert(15);
@@ -56,8 +102,8 @@ TEST(AVLTreeRangeQueryIntTest, SimpleTreeThreeNodes) {
     EXPECT_EQ(tree.RangeQuery(15, 5), 0);
 }
 
-TEST(AVLTreeRangeQueryIntTest, LargerTreeExample) {
-    AVLTree<int> tree;
+TYPED_TEST(RangeQueryIntTest, LargerTreeExample) {
+    TypeParam tree;
     const std::vector<int> values = {50, 30, 70, 20, 40, 60, 80};
     for (int val : values) {
         tree.Insert(val);
@@ -108,8 +154,8 @@ TEST(AVLTreeRangeQueryStringTest, StringData) {
     EXPECT_EQ(tree.RangeQuery("a", "z"), 5);
 }
 
-TEST(AVLTreeRangeQueryComplexTest, LargeSortedAscending) {
-    AVLTree<int> tree;
+TYPED_TEST(RangeQueryComplexTest, LargeSortedAscending) {
+    TypeParam tree;
     const int n = 2000;
     for (int i = 1; i <= n; ++i) {
         tree.Insert(i);
@@ -131,8 +177,8 @@ TEST(AVLTreeRangeQueryComplexTest, LargeSortedAscending) {
     EXPECT_EQ(tree.RangeQuery(n, 1), 0) << "Некорректный диапазон max < min";
 }
 
-TEST(AVLTreeRangeQueryComplexTest, LargeSortedDescending) {
-    AVLTree<int> tree;
+TYPED_TEST(RangeQueryComplexTest, LargeSortedDescending) {
+    TypeParam tree;
     const int n = 2000;
     for (int i = n; i >= 1; --i) {
         tree.Insert(i);
@@ -148,8 +194,8 @@ TEST(AVLTreeRangeQueryComplexTest, LargeSortedDescending) {
     EXPECT_EQ(tree.RangeQuery(0, 0), 0);
 }
 
-TEST(AVLTreeRangeQueryComplexTest, AfterSpecificRotations) {
-    AVLTree<int> tree;
+TYPED_TEST(RangeQueryComplexTest, AfterSpecificRotations) {
+    TypeParam tree;
 
     const std::vector<int> values = {10, 20, 30, 40, 50, 25, 15, 5, 28, 45};
 
@@ -168,8 +214,8 @@ TEST(AVLTreeRangeQueryComplexTest, AfterSpecificRotations) {
     EXPECT_EQ(tree.RangeQuery(28, 28), 1);
 }
 
-TEST(AVLTreeRangeQueryComplexTest, IntegerLimits) {
-    AVLTree<int> tree;
+TYPED_TEST(RangeQueryComplexTest, IntegerLimits) {
+    TypeParam tree;
     const int min_int = std::numeric_limits<int>::min();
     const int max_int = std::numeric_limits<int>::max();
 
@@ -195,6 +241,43 @@ TEST(AVLTreeRangeQueryComplexTest, IntegerLimits) {
     EXPECT_EQ(tree.RangeQuery(1, max_int - 1), (max_int > 1 ? 2u : 1u));
 }
 
+TYPED_TEST(RangeQueryComplexTest, RandomAgainstStdSet) {
+    TypeParam index;
+    std::set<int> reference;
+    std::mt19937 gen(21);
+    std::uniform_int_distribution<int> key(-5000, 5000);
+
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < 500; ++i) {
+            int k = key(gen);
+            EXPECT_EQ(index.Insert(k), reference.insert(k).second);
+        }
+        // a batch big enough to take the engines' bulk paths
+        std::vector<int> batch(1000);
+        std::generate(batch.begin(), batch.end(), [&] { return key(gen); });
+        InsertAll<int>(index, batch.begin(), batch.end());
+        reference.insert(batch.begin(), batch.end());
+
+        ASSERT_EQ(index.Size(), reference.size());
+        for (int i = 0; i < 200; ++i) {
+            int a = key(gen);
+            int b = key(gen);
+            size_t expected = a <= b ? static_cast<size_t>(std::distance(
+                                           reference.lower_bound(a),
+                                           reference.upper_bound(b)))
+                                     : 0;
+            ASSERT_EQ(index.RangeQuery(a, b), expected);
+        }
+    }
+
+    EXPECT_TRUE(std::ranges::equal(index, reference));
+    EXPECT_EQ(SortedKeys<int>(index),
+              std::vector<int>(reference.begin(), reference.end()));
+    if constexpr (requires { index.IsValid(); }) {
+        EXPECT_TRUE(index.IsValid());
+    }
+}
+
 TEST(AVLTreeRangeQueryComplexTest, FloatingPointPrecision) {
     AVLTree<double> tree;
     tree.Insert(1.0);
@@ -212,8 +295,1514 @@ TEST(AVLTreeRangeQueryComplexTest, FloatingPointPrecision) {
     EXPECT_EQ(tree.RangeQuery(1.1, 2.9), 1);
 }
 
+TEST(AVLTreeRankTest, CountLessAndCountLessEqual) {
+    AVLTree<int> tree;
+    for (int val : {50, 30, 70, 20, 40, 60, 80}) {
+        tree.Insert(val);
+    }
+
+    EXPECT_EQ(tree.Size(), 7);
+    EXPECT_EQ(tree.CountLess(20), 0);
+    EXPECT_EQ(tree.CountLessEqual(20), 1);
+    EXPECT_EQ(tree.CountLess(45), 3);
+    EXPECT_EQ(tree.CountLessEqual(45), 3);
+    EXPECT_EQ(tree.CountLess(80), 6);
+    EXPECT_EQ(tree.CountLessEqual(80), 7);
+    EXPECT_EQ(tree.CountLess(100), 7);
+}
+
+TEST(AVLTreeRankTest, RankAndSelect) {
+    AVLTree<int> tree;
+    for (int val : {10, 20, 30, 40, 50, 25, 15, 5, 28, 45}) {
+        tree.Insert(val);
+    }
+    const std::vector<int> sorted = {5, 10, 15, 20, 25, 28, 30, 40, 45, 50};
+
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        EXPECT_EQ(tree.Select(i), sorted[i]);
+        EXPECT_EQ(tree.Rank(sorted[i]), i);
+    }
+    EXPECT_FALSE(tree.Rank(26).has_value());
+    EXPECT_THROW(static_cast<void>(tree.Select(sorted.size())),
+                 IndexOutOfRangeException);
+}
+
+TEST(AVLTreeRankTest, RandomAgainstStdSet) {
+    AVLTree<int> tree;
+    std::set<int> reference_set;
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> dist(-1000, 1000);
+
+    for (int i = 0; i < 3000; ++i) {
+        int key = dist(gen);
+        tree.Insert(key);
+        reference_set.insert(key);
+
+        int a = dist(gen);
+        int b = dist(gen);
+        size_t expected =
+            a > b ? 0
+                  : std::distance(reference_set.lower_bound(a),
+                                  reference_set.upper_bound(b));
+        ASSERT_EQ(tree.RangeQuery(a, b), expected);
+    }
+    EXPECT_EQ(tree.Size(), reference_set.size());
+}
+
+TEST(AVLTreeArenaTest, SmallBlocksAndMove) {
+    AVLTree<int, std::less<int>, ArenaStorage<2>> tree;
+    const int n = 1000;
+    for (int i = 0; i < n; ++i) {
+        tree.Insert((i * 7919) % n);
+    }
+    EXPECT_EQ(tree.RangeQuery(0, n - 1), n);
+
+    AVLTree<int, std::less<int>, ArenaStorage<2>> moved(std::move(tree));
+    EXPECT_EQ(moved.RangeQuery(100, 199), 100);
+    EXPECT_EQ(tree.RangeQuery(0, n - 1), 0);
+
+    tree = std::move(moved);
+    EXPECT_EQ(tree.Size(), n);
+    EXPECT_EQ(moved.Size(), 0);
+}
+
+TEST(AVLTreeArenaTest, FreedSlotsAreReused) {
+    struct Payload {
+        int value;
+    };
+    NodeArena<Payload, 2> arena;
+    NodeIndex first = arena.Allocate(Payload{1});
+    NodeIndex second = arena.Allocate(Payload{2});
+    EXPECT_NE(first, kNullIndex);
+    EXPECT_EQ(arena.Size(), 2);
+
+    arena.Deallocate(first);
+    NodeIndex third = arena.Allocate(Payload{3});
+    EXPECT_EQ(third, first);
+    EXPECT_EQ(arena[third].value, 3);
+    EXPECT_EQ(arena[second].value, 2);
+
+    arena.Release();
+    EXPECT_EQ(arena.BlockCount(), 0);
+    EXPECT_EQ(arena.Size(), 0);
+}
+
+TEST(AVLTreeInsertTest, ReportsDuplicates) {
+    AVLTree<int> tree;
+    EXPECT_TRUE(tree.Insert(10));
+    EXPECT_TRUE(tree.Insert(5));
+    EXPECT_FALSE(tree.Insert(10));
+    EXPECT_FALSE(tree.Insert(5));
+    EXPECT_EQ(tree.Size(), 2);
+}
+
+TEST(AVLTreeInsertTest, ZigZagInsertsKeepOrder) {
+    AVLTree<int> tree;
+    const int n = 4096;
+    for (int i = 0; i < n / 2; ++i) {
+        tree.Insert(i);
+        tree.Insert(n - 1 - i);
+    }
+
+    for (int i = 0; i < n; i += 97) {
+        EXPECT_EQ(tree.Select(i), i);
+        EXPECT_EQ(tree.CountLess(i), i);
+    }
+}
+
+TEST(AVLTreeBulkLoadTest, FromUnsortedRangeWithDuplicates) {
+    const std::vector<int> values = {40, 10, 30, 10, 20, 50, 30, 0};
+    auto tree = AVLTree<int>::FromRange(values.begin(), values.end());
+
+    EXPECT_EQ(tree.Size(), 6);
+    EXPECT_EQ(tree.RangeQuery(10, 40), 4);
+    for (size_t i = 0; i < tree.Size(); ++i) {
+        EXPECT_EQ(tree.Select(i), static_cast<int>(i) * 10);
+    }
+    EXPECT_FALSE(tree.Insert(20));
+    EXPECT_TRUE(tree.Insert(25));
+    EXPECT_EQ(tree.RangeQuery(20, 30), 3);
+}
+
+TEST(AVLTreeBulkLoadTest, MergeIntoExistingTree) {
+    std::set<int> reference_set;
+    std::vector<int> initial;
+    for (int i = 0; i < 1000; i += 2) {
+        initial.push_back(i);
+        reference_set.insert(i);
+    }
+    auto tree = AVLTree<int>::FromRange(initial.begin(), initial.end());
+
+    // small batch takes the key-by-key path, large one the rebuild path
+    const std::vector<int> small_batch = {7, 3, 2000, 4};
+    std::vector<int> large_batch;
+    for (int i = 500; i < 3000; i += 3) {
+        large_batch.push_back(i);
+    }
+    for (const auto &batch : {small_batch, large_batch}) {
+        tree.BulkLoad(batch.begin(), batch.end());
+        reference_set.insert(batch.begin(), batch.end());
+
+        ASSERT_EQ(tree.Size(), reference_set.size());
+        size_t i = 0;
+        for (int key : reference_set) {
+            ASSERT_EQ(tree.Select(i++), key);
+        }
+    }
+}
+
+TEST(AVLTreeBulkLoadTest, StringKeys) {
+    const std::vector<std::string> words = {"fig", "apple", "date", "banana",
+                                            "apple", "cherry"};
+    auto tree = AVLTree<std::string>::FromRange(words.begin(), words.end());
+    EXPECT_EQ(tree.Size(), 5);
+    EXPECT_EQ(tree.Select(0), "apple");
+    EXPECT_EQ(tree.RangeQuery("b", "d"), 2);
+
+    const std::vector<std::string> more = {"grape", "kiwi", "apple"};
+    tree.BulkLoad(more.begin(), more.end());
+    EXPECT_EQ(tree.Size(), 7);
+    EXPECT_EQ(tree.Select(6), "kiwi");
+}
+
+TEST(AVLTreeBatchQueryTest, ParallelMatchesSequential) {
+    std::vector<int> keys;
+    for (int i = 0; i < 20000; ++i) {
+        keys.push_back((i * 7919) % 50000);
+    }
+    auto tree = AVLTree<int>::FromRange(keys.begin(), keys.end());
+
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<int> dist(-100, 50100);
+    std::vector<std::pair<int, int>> queries(10000);
+    for (auto &[a, b] : queries) {
+        a = dist(gen);
+        b = dist(gen);
+    }
+
+    ThreadPool pool(4);
+    std::vector<size_t> parallel = tree.RangeQueryBatch(queries, &pool);
+    ASSERT_EQ(parallel.size(), queries.size());
+    for (size_t i = 0; i < queries.size(); ++i) {
+        ASSERT_EQ(parallel[i],
+                  tree.RangeQuery(queries[i].first, queries[i].second));
+    }
+}
+
+TEST(AVLTreeBatchQueryTest, LockstepMatchesSequential) {
+    // small enough for the plain loop, and large enough (a few MiB of
+    // nodes) for the interleaved descents
+    for (int size : {0, 1000, 400000}) {
+        std::mt19937 gen(size);
+        std::uniform_int_distribution<int> dist(-10, 3 * size + 10);
+        AVLTree<int> tree;
+        for (int i = 0; i < size; ++i) {
+            tree.Insert(dist(gen));
+        }
+
+        std::vector<int> keys(5000);
+        std::vector<std::pair<int, int>> queries(5000);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            keys[i] = dist(gen);
+            queries[i] = {dist(gen), dist(gen)};  // some with max < min
+        }
+
+        std::vector<size_t> counts = tree.CountLessBatch(keys);
+        std::vector<size_t> ranges = tree.RangeQueryBatch(queries);
+        ASSERT_EQ(counts.size(), keys.size());
+        ASSERT_EQ(ranges.size(), queries.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            ASSERT_EQ(counts[i], tree.CountLess(keys[i]));
+            ASSERT_EQ(ranges[i],
+                      tree.RangeQuery(queries[i].first, queries[i].second));
+        }
+    }
+}
+
+TEST(ThreadPoolTest, ParallelForCoversEveryIndexOnce) {
+    ThreadPool pool(4);
+    // fewer items than threads, and just past a multiple of min_chunk
+    const std::pair<size_t, size_t> cases[] = {
+        {10001, 100}, {5, 1},       {3, 1},      {7, 2},
+        {2049, 1024}, {1025, 1024}, {1000, 1024}, {0, 16}};
+    for (auto [count, min_chunk] : cases) {
+        std::vector<int> hits(count, 0);
+        std::vector<std::pair<size_t, size_t>> ranges;
+        std::mutex mutex;
+        pool.ParallelFor(count, min_chunk, [&](size_t begin, size_t end) {
+            {
+                std::lock_guard lock(mutex);
+                ranges.emplace_back(begin, end);
+            }
+            for (size_t i = begin; i < end; ++i) {
+                ++hits[i];
+            }
+        });
+        EXPECT_EQ(std::count(hits.begin(), hits.end(), 1), count);
+        EXPECT_LE(ranges.size(), pool.Size());
+        for (auto [begin, end] : ranges) {
+            EXPECT_LT(begin, end) << count << " " << min_chunk;
+            if (ranges.size() > 1) {
+                EXPECT_GE(end - begin, min_chunk) << count << " " << min_chunk;
+            }
+        }
+    }
+}
+
+TEST(FrozenRangeIndexTest, MatchesTreeForInts) {
+    std::mt19937 gen(11);
+    std::uniform_int_distribution<int> dist(-5000, 5000);
+    for (size_t n : {0, 1, 15, 16, 17, 255, 256, 4097}) {
+        AVLTree<int> tree;
+        while (tree.Size() < n) {
+            tree.Insert(dist(gen));
+        }
+        FrozenRangeIndex<int> frozen = tree.Freeze();
+        ASSERT_EQ(frozen.Size(), n);
+
+        for (int i = 0; i < 2000; ++i) {
+            int a = dist(gen);
+            int b = dist(gen);
+            ASSERT_EQ(frozen.CountLess(a), tree.CountLess(a));
+            ASSERT_EQ(frozen.CountLessEqual(a), tree.CountLessEqual(a));
+            ASSERT_EQ(frozen.RangeQuery(a, b), tree.RangeQuery(a, b));
+        }
+    }
+}
+
+TEST(FrozenRangeIndexTest, IntegerLimitsAndStrings) {
+    const int min_int = std::numeric_limits<int>::min();
+    const int max_int = std::numeric_limits<int>::max();
+    FrozenRangeIndex<int> ints({min_int, -1, 0, 1, max_int});
+    EXPECT_EQ(ints.RangeQuery(min_int, max_int), 5);
+    EXPECT_EQ(ints.RangeQuery(max_int, max_int), 1);
+    EXPECT_EQ(ints.RangeQuery(min_int, min_int), 1);
+    EXPECT_EQ(ints.CountLess(max_int), 4);
+
+    FrozenRangeIndex<std::string> words(
+        {"apple", "banana", "cherry", "date", "fig"});
+    EXPECT_EQ(words.RangeQuery("banana", "date"), 3);
+    EXPECT_EQ(words.RangeQuery("blueberry", "cranberry"), 1);
+    EXPECT_EQ(words.RangeQuery("grape", "kiwi"), 0);
+}
+
+static_assert(std::forward_iterator<AVLTree<int>::InOrderIterator>);
+static_assert(std::forward_iterator<AVLTree<std::string>::PreOrderIterator>);
+static_assert(std::ranges::forward_range<const AVLTree<int>>);
+
+TEST(AVLTreeIteratorTest, TraversalOrders) {
+    AVLTree<int> tree;
+    for (int val : {50, 30, 70, 20, 40, 60, 80}) {
+        tree.Insert(val);
+    }
+
+    std::vector<int> pre_order;
+    for (auto it = tree.BeginPreOrder(); it != tree.EndPreOrder(); ++it) {
+        pre_order.push_back(*it);
+    }
+    EXPECT_EQ(pre_order, (std::vector<int>{50, 30, 20, 40, 70, 60, 80}));
+
+    std::vector<int> in_order(tree.begin(), tree.end());
+    EXPECT_EQ(in_order, (std::vector<int>{20, 30, 40, 50, 60, 70, 80}));
+
+    AVLTree<int> empty;
+    EXPECT_EQ(empty.begin(), empty.end());
+    EXPECT_EQ(empty.BeginPreOrder(), empty.EndPreOrder());
+}
+
+TEST(AVLTreeIteratorTest, WorksWithRanges) {
+    AVLTree<int> tree;
+    for (int i = 1000; i > 0; --i) {
+        tree.Insert(i);
+    }
+
+    EXPECT_EQ(std::ranges::distance(tree), 1000);
+    EXPECT_TRUE(std::ranges::is_sorted(tree));
+    EXPECT_EQ(
+        std::ranges::count_if(tree, [](int key) { return key % 10 == 0; }),
+        100);
+
+    auto it = tree.begin();
+    auto copy = it++;
+    EXPECT_EQ(*copy, 1);
+    EXPECT_EQ(*it, 2);
+    EXPECT_NE(copy, it);
+}
+
+TEST(AVLTreeBoundedRangeTest, LowerAndUpperBound) {
+    AVLTree<int> tree;
+    for (int val : {50, 30, 70, 20, 40, 60, 80}) {
+        tree.Insert(val);
+    }
+
+    EXPECT_EQ(*tree.LowerBound(40), 40);
+    EXPECT_EQ(*tree.UpperBound(40), 50);
+    EXPECT_EQ(*tree.LowerBound(41), 50);
+    EXPECT_EQ(*tree.LowerBound(0), 20);
+    EXPECT_EQ(tree.LowerBound(81), tree.end());
+    EXPECT_EQ(tree.UpperBound(80), tree.end());
+    EXPECT_EQ(tree.LowerBound(20), tree.begin());
+
+    std::vector<int> tail(tree.LowerBound(55), tree.end());
+    EXPECT_EQ(tail, (std::vector<int>{60, 70, 80}));
+}
+
+TEST(AVLTreeBoundedRangeTest, ForEachAndCollectAgainstStdSet) {
+    AVLTree<int> tree;
+    std::set<int> reference_set;
+    std::mt19937 gen(5);
+    std::uniform_int_distribution<int> dist(0, 5000);
+    for (int i = 0; i < 2000; ++i) {
+        int key = dist(gen);
+        tree.Insert(key);
+        reference_set.insert(key);
+    }
+
+    std::vector<int> buffer(64);
+    for (int i = 0; i < 500; ++i) {
+        int a = dist(gen);
+        int b = a + dist(gen) % 200;
+        std::vector<int> expected(reference_set.lower_bound(a),
+                                  reference_set.upper_bound(b));
+
+        std::vector<int> visited;
+        tree.ForEachInRange(a, b, [&](int key) { visited.push_back(key); });
+        ASSERT_EQ(visited, expected);
+
+        size_t written = tree.CollectRange(a, b, buffer);
+        ASSERT_EQ(written, std::min(expected.size(), buffer.size()));
+        ASSERT_TRUE(std::equal(buffer.begin(), buffer.begin() + written,
+                               expected.begin()));
+    }
+
+    EXPECT_EQ(tree.CollectRange(10, 5, buffer), 0);
+}
+
+TEST(AVLTreeEraseTest, RandomAgainstStdSet) {
+    AVLTree<int> tree;
+    std::set<int> reference_set;
+    std::mt19937 gen(17);
+    std::uniform_int_distribution<int> dist(0, 500);
+
+    for (int i = 0; i < 5000; ++i) {
+        int key = dist(gen);
+        if (gen() % 3 == 0) {
+            ASSERT_EQ(tree.Erase(key), reference_set.erase(key) == 1);
+        } else {
+            ASSERT_EQ(tree.Insert(key), reference_set.insert(key).second);
+        }
+        ASSERT_EQ(tree.Size(), reference_set.size());
+        if (i % 100 == 0) {
+            ASSERT_TRUE(tree.IsValid());
+            ASSERT_TRUE(std::equal(tree.begin(), tree.end(),
+                                   reference_set.begin(),
+                                   reference_set.end()));
+        }
+    }
+    EXPECT_TRUE(tree.IsValid());
+}
+
+TEST(AVLTreeEraseTest, EraseRange) {
+    std::vector<int> keys;
+    for (int i = 0; i < 1000; ++i) {
+        keys.push_back(i);
+    }
+    auto ints = AVLTree<int>::FromRange(keys.begin(), keys.end());
+
+    EXPECT_EQ(ints.EraseRange(100, 199), 100);
+    EXPECT_TRUE(ints.IsValid());
+    EXPECT_EQ(ints.Size(), 900);
+    EXPECT_EQ(ints.RangeQuery(0, 999), 900);
+    EXPECT_EQ(ints.RangeQuery(100, 199), 0);
+    EXPECT_EQ(ints.EraseRange(150, 160), 0);
+    EXPECT_EQ(ints.EraseRange(0, 0), 1);
+    EXPECT_EQ(ints.EraseRange(900, 5000), 100);
+    EXPECT_EQ(ints.EraseRange(10, 5), 0);
+    EXPECT_TRUE(ints.IsValid());
+    EXPECT_EQ(ints.Size(), 799);
+    EXPECT_EQ(ints.Select(0), 1);
+    EXPECT_EQ(ints.Select(798), 899);
+
+    EXPECT_EQ(ints.EraseRange(-1, 1000), 799);
+    EXPECT_EQ(ints.Size(), 0);
+    EXPECT_TRUE(ints.Insert(5));
+    EXPECT_TRUE(ints.IsValid());
+}
+
+TEST(AVLTreeEraseTest, RandomEraseRangeKeepsBalance) {
+    std::mt19937 gen(23);
+    std::uniform_int_distribution<int> dist(0, 20000);
+    for (int round = 0; round < 20; ++round) {
+        AVLTree<int> tree;
+        std::set<int> reference_set;
+        for (int i = 0; i < 3000; ++i) {
+            int key = dist(gen);
+            tree.Insert(key);
+            reference_set.insert(key);
+        }
+
+        int a = dist(gen);
+        int b = a + dist(gen) % 5000;
+        auto first = reference_set.lower_bound(a);
+        auto last = reference_set.upper_bound(b);
+        size_t expected = std::distance(first, last);
+        reference_set.erase(first, last);
+
+        ASSERT_EQ(tree.EraseRange(a, b), expected);
+        ASSERT_TRUE(tree.IsValid());
+        ASSERT_TRUE(std::equal(tree.begin(), tree.end(),
+                               reference_set.begin(), reference_set.end()));
+    }
+}
+
+TEST(AVLMultisetTest, CountsOccurrences) {
+    AVLMultiset<int> tree;
+    for (int val : {5, 3, 5, 8, 5, 3, 1}) {
+        EXPECT_TRUE(tree.Insert(val));
+    }
+
+    EXPECT_EQ(tree.Size(), 7);
+    EXPECT_EQ(tree.Count(5), 3);
+    EXPECT_EQ(tree.Count(4), 0);
+    EXPECT_EQ(tree.RangeQuery(3, 5), 5);
+    EXPECT_EQ(tree.CountLess(5), 3);
+    EXPECT_EQ(tree.CountLessEqual(5), 6);
+    EXPECT_EQ(tree.Rank(5), 3);
+    EXPECT_EQ(tree.Select(3), 5);
+    EXPECT_EQ(tree.Select(5), 5);
+    EXPECT_EQ(tree.Select(6), 8);
+
+    std::vector<int> in_order(tree.begin(), tree.end());
+    EXPECT_EQ(in_order, (std::vector<int>{1, 3, 3, 5, 5, 5, 8}));
+
+    EXPECT_TRUE(tree.Erase(5));
+    EXPECT_EQ(tree.Count(5), 2);
+    EXPECT_EQ(tree.RangeQuery(5, 5), 2);
+    EXPECT_EQ(tree.EraseRange(3, 5), 4);
+    EXPECT_EQ(tree.Size(), 2);
+    EXPECT_TRUE(tree.IsValid());
+}
+
+TEST(AVLMultisetTest, RandomAgainstStdMultiset) {
+    AVLMultiset<int> tree;
+    std::multiset<int> reference_set;
+    std::mt19937 gen(29);
+    std::uniform_int_distribution<int> dist(0, 300);
+
+    for (int i = 0; i < 5000; ++i) {
+        int key = dist(gen);
+        if (gen() % 3 == 0) {
+            auto it = reference_set.find(key);
+            ASSERT_EQ(tree.Erase(key), it != reference_set.end());
+            if (it != reference_set.end()) reference_set.erase(it);
+        } else {
+            tree.Insert(key);
+            reference_set.insert(key);
+        }
+
+        int a = dist(gen);
+        int b = dist(gen);
+        size_t expected =
+            a > b ? 0
+                  : std::distance(reference_set.lower_bound(a),
+                                  reference_set.upper_bound(b));
+        ASSERT_EQ(tree.RangeQuery(a, b), expected);
+    }
+    EXPECT_TRUE(tree.IsValid());
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), reference_set.begin(),
+                           reference_set.end()));
+}
+
+TEST(AVLMultisetTest, BulkLoadKeepsDuplicates) {
+    const std::vector<int> values = {4, 1, 4, 2, 4, 1};
+    auto tree = AVLMultiset<int>::FromRange(values.begin(), values.end());
+    EXPECT_EQ(tree.Size(), 6);
+    EXPECT_EQ(tree.Count(4), 3);
+
+    const std::vector<int> more = {4, 3, 1, 1};
+    tree.BulkLoad(more.begin(), more.end());
+    EXPECT_EQ(tree.Size(), 10);
+    EXPECT_EQ(tree.Count(1), 4);
+    EXPECT_EQ(tree.Count(4), 4);
+    EXPECT_EQ(tree.RangeQuery(2, 3), 2);
+    EXPECT_TRUE(tree.IsValid());
+}
+
+TEST(AVLTreeSplitJoinTest, SplitAndJoinBack) {
+    std::mt19937 gen(31);
+    std::uniform_int_distribution<int> dist(0, 50000);
+    for (int round = 0; round < 20; ++round) {
+        AVLTree<int> tree;
+        std::set<int> reference_set;
+        for (int i = 0; i < 4000; ++i) {
+            int key = dist(gen);
+            tree.Insert(key);
+            reference_set.insert(key);
+        }
+
+        int pivot = dist(gen);
+        auto [below, rest] = tree.Split(pivot);
+        EXPECT_EQ(tree.Size(), 0);
+        ASSERT_TRUE(below.IsValid());
+        ASSERT_TRUE(rest.IsValid());
+        auto middle = reference_set.lower_bound(pivot);
+        ASSERT_TRUE(std::equal(below.begin(), below.end(),
+                               reference_set.begin(), middle));
+        ASSERT_TRUE(
+            std::equal(rest.begin(), rest.end(), middle, reference_set.end()));
+
+        // both halves keep working on the shared pool
+        below.Insert(pivot - 100000);
+        rest.Insert(pivot + 100000);
+        reference_set.insert({pivot - 100000, pivot + 100000});
+
+        tree = AVLTree<int>::Join(std::move(below), std::move(rest));
+        EXPECT_EQ(below.Size(), 0);
+        EXPECT_EQ(rest.Size(), 0);
+        ASSERT_TRUE(tree.IsValid());
+        ASSERT_TRUE(std::equal(tree.begin(), tree.end(),
+                               reference_set.begin(), reference_set.end()));
+    }
+}
+
+TEST(AVLTreeSplitJoinTest, JoinSeparateTrees) {
+    AVLTree<int> small;
+    AVLTree<int> large;
+    for (int key = 0; key < 10; ++key) {
+        small.Insert(key);
+    }
+    for (int key = 100; key < 1100; ++key) {
+        large.Insert(key);
+    }
+
+    auto joined = AVLTree<int>::Join(std::move(small), std::move(large));
+    EXPECT_EQ(joined.Size(), 1010);
+    EXPECT_EQ(joined.RangeQuery(5, 104), 10);
+    EXPECT_TRUE(joined.IsValid());
+
+    AVLTree<int> empty;
+    joined = AVLTree<int>::Join(std::move(empty), std::move(joined));
+    EXPECT_EQ(joined.Size(), 1010);
+}
+
+TEST(AVLTreeSplitJoinTest, JoinRejectsOverlappingTrees) {
+    AVLTree<int> left;
+    AVLTree<int> right;
+    left.Insert(5);
+    right.Insert(5);
+    EXPECT_THROW(
+        {
+            auto joined =
+                AVLTree<int>::Join(std::move(left), std::move(right));
+        },
+        UnorderedJoinException);
+}
+
+TEST(AVLTreeSplitJoinTest, SplitMultiset) {
+    const std::vector<int> values = {3, 1, 3, 2, 3, 4};
+    auto tree = AVLMultiset<int>::FromRange(values.begin(), values.end());
+    auto [below, rest] = tree.Split(3);
+    EXPECT_EQ(below.Size(), 2);
+    EXPECT_EQ(rest.Size(), 4);
+    EXPECT_EQ(rest.Count(3), 3);
+
+    tree = AVLMultiset<int>::Join(std::move(below), std::move(rest));
+    EXPECT_EQ(tree.Size(), 6);
+    EXPECT_TRUE(tree.IsValid());
+}
+
+TEST(ShardedAVLTreeTest, MatchesStdSetAcrossRebalances) {
+    ShardedAVLTree<int> tree(4);
+    std::set<int> reference_set;
+    std::mt19937 gen(37);
+    std::uniform_int_distribution<int> dist(0, 1 << 20);
+
+    for (int i = 0; i < 40000; ++i) {
+        // the key distribution drifts upwards
+        int key = dist(gen) / 4 + i * 16;
+        ASSERT_EQ(tree.Insert(key), reference_set.insert(key).second);
+
+        int a = dist(gen);
+        int b = a + dist(gen) / 8;
+        ASSERT_EQ(tree.RangeQuery(a, b),
+                  std::distance(reference_set.lower_bound(a),
+                                reference_set.upper_bound(b)));
+    }
+    EXPECT_EQ(tree.Size(), reference_set.size());
+    EXPECT_TRUE(tree.IsValid());
+
+    auto sizes = tree.ShardSizes();
+    EXPECT_EQ(sizes.size(), 4);
+    for (size_t size : sizes) {
+        EXPECT_LE(size, 3 * reference_set.size() / 4 + 1024);
+    }
+
+    tree.Rebalance();
+    EXPECT_TRUE(tree.IsValid());
+    for (size_t size : tree.ShardSizes()) {
+        EXPECT_NEAR(static_cast<double>(size), reference_set.size() / 4.0, 1);
+    }
+}
+
+TEST(ShardedAVLTreeTest, ConcurrentInsertsAndQueries) {
+    constexpr int kThreads = 4;
+    constexpr int kKeysPerThread = 20000;
+    ShardedAVLTree<int> tree(kThreads);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&tree, t] {
+            std::mt19937 gen(t);
+            for (int i = 0; i < kKeysPerThread; ++i) {
+                tree.Insert(i * kThreads + t);
+                int a = static_cast<int>(gen() % (kThreads * kKeysPerThread));
+                EXPECT_LE(tree.RangeQuery(a, a + 100), 101);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(tree.Size(), kThreads * kKeysPerThread);
+    EXPECT_EQ(tree.RangeQuery(0, kThreads * kKeysPerThread), tree.Size());
+    EXPECT_EQ(tree.RangeQuery(1000, 1999), 1000);
+    EXPECT_TRUE(tree.IsValid());
+}
+
+TEST(ShardedAVLTreeTest, RebalancesRaceWithInsertsAndQueries) {
+    // the even keys are there from the start, so a query that reads a shard
+    // under stale bounds would come up short of them
+    constexpr int kKeys = 1 << 15;
+    ShardedAVLTree<int> tree(4);
+    for (int key = 0; key < kKeys; key += 2) {
+        tree.Insert(key);
+    }
+
+    std::atomic<bool> done = false;
+    std::thread rebalancer([&] {
+        for (int i = 0; i < 200 && !done; ++i) {
+            tree.Rebalance();
+        }
+    });
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; ++t) {
+        threads.emplace_back([&tree, t] {
+            std::mt19937 gen(t);
+            for (int key = 1 + 2 * t; key < kKeys; key += 4) {
+                tree.Insert(key);
+                int a = static_cast<int>(gen() % kKeys);
+                int b = a + static_cast<int>(gen() % 2000);
+                size_t count = tree.RangeQuery(a, b);
+                int evens = (std::min(b, kKeys - 1) / 2) - (a + 1) / 2 + 1;
+                ASSERT_GE(count, static_cast<size_t>(evens));
+                ASSERT_LE(count, static_cast<size_t>(b - a + 1));
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    done = true;
+    rebalancer.join();
+
+    EXPECT_EQ(tree.Size(), kKeys);
+    EXPECT_EQ(tree.RangeQuery(0, kKeys), kKeys);
+    EXPECT_TRUE(tree.IsValid());
+}
+
+TEST(PersistentAVLTreeTest, SnapshotsKeepTheirVersion) {
+    PersistentAVLTree<int> tree;
+    std::vector<PersistentAVLTree<int>::Snapshot> history;
+    std::set<int> reference_set;
+    std::vector<std::set<int>> reference_history;
+    std::mt19937 gen(41);
+    std::uniform_int_distribution<int> dist(0, 5000);
+
+    for (int i = 0; i < 4000; ++i) {
+        int key = dist(gen);
+        ASSERT_EQ(tree.Insert(key), reference_set.insert(key).second);
+        if (i % 500 == 0) {
+            history.push_back(tree.GetSnapshot());
+            reference_history.push_back(reference_set);
+        }
+    }
+    EXPECT_EQ(tree.Size(), reference_set.size());
+    EXPECT_EQ(tree.GetSnapshot().Version(), reference_set.size());
+    EXPECT_LE(tree.GetSnapshot().Height(), 20);
+
+    for (size_t v = 0; v < history.size(); ++v) {
+        const auto &expected = reference_history[v];
+        EXPECT_EQ(history[v].Size(), expected.size());
+        for (int a = 0; a < 5000; a += 250) {
+            int b = a + 700;
+            ASSERT_EQ(history[v].RangeQuery(a, b),
+                      std::distance(expected.lower_bound(a),
+                                    expected.upper_bound(b)));
+        }
+    }
+}
+
+TEST(PersistentAVLTreeTest, ReadersSeeConsistentSnapshots) {
+    PersistentAVLTree<int> tree;
+    std::atomic<bool> done = false;
+
+    // keys are inserted in order, so every snapshot holds exactly
+    // 0 .. Size() - 1
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; ++t) {
+        readers.emplace_back([&tree, &done] {
+            while (!done.load()) {
+                auto snapshot = tree.GetSnapshot();
+                int size = static_cast<int>(snapshot.Size());
+                ASSERT_EQ(snapshot.RangeQuery(0, size), size);
+                ASSERT_EQ(snapshot.CountLess(size / 2), size / 2);
+            }
+        });
+    }
+    for (int key = 0; key < 20000; ++key) {
+        tree.Insert(key);
+    }
+    done = true;
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    EXPECT_EQ(tree.RangeQuery(0, 19999), 20000);
+}
+
+TEST(SnapshotTest, SaveLoadAndMap) {
+    const std::string path = testing::TempDir() + "avl_snapshot_test.bin";
+    AVLTree<int> tree;
+    std::mt19937 gen(43);
+    std::uniform_int_distribution<int> dist(-100000, 100000);
+    for (int i = 0; i < 20001; ++i) {
+        tree.Insert(dist(gen));
+    }
+    tree.SaveSnapshot(path);
+
+    auto loaded = AVLTree<int>::LoadSnapshot(path);
+    EXPECT_TRUE(loaded.IsValid());
+    EXPECT_TRUE(
+        std::equal(loaded.begin(), loaded.end(), tree.begin(), tree.end()));
+
+    MappedSnapshot<int> mapped(path);
+    EXPECT_EQ(mapped.Size(), tree.Size());
+    for (int i = 0; i < 1000; ++i) {
+        int a = dist(gen);
+        int b = dist(gen);
+        ASSERT_EQ(mapped.RangeQuery(a, b), tree.RangeQuery(a, b));
+        ASSERT_EQ(mapped.CountLess(a), tree.CountLess(a));
+    }
+    EXPECT_EQ(mapped.Select(777), tree.Select(777));
+    EXPECT_THROW(static_cast<void>(mapped.Select(tree.Size())),
+                 IndexOutOfRangeException);
+
+    AVLTree<int>().SaveSnapshot(path);
+    EXPECT_EQ(AVLTree<int>::LoadSnapshot(path).Size(), 0);
+    EXPECT_EQ(MappedSnapshot<int>(path).RangeQuery(0, 10), 0);
+    std::remove(path.c_str());
+}
+
+TEST(SnapshotTest, MultisetKeepsCounts) {
+    const std::string path = testing::TempDir() + "avl_snapshot_multi.bin";
+    const std::vector<int> values = {7, 1, 7, 3, 7, 1, 9};
+    auto tree = AVLMultiset<int>::FromRange(values.begin(), values.end());
+    tree.SaveSnapshot(path);
+
+    auto loaded = AVLMultiset<int>::LoadSnapshot(path);
+    EXPECT_EQ(loaded.Size(), 7);
+    EXPECT_EQ(loaded.Count(7), 3);
+    EXPECT_TRUE(loaded.IsValid());
+
+    MappedSnapshot<int> mapped(path);
+    EXPECT_EQ(mapped.Size(), 7);
+    EXPECT_EQ(mapped.RangeQuery(1, 3), 3);
+    EXPECT_EQ(mapped.RangeQuery(7, 9), 4);
+    EXPECT_EQ(mapped.Select(4), 7);
+    std::remove(path.c_str());
+}
+
+TEST(SnapshotTest, RejectsDamagedFiles) {
+    const std::string path = testing::TempDir() + "avl_snapshot_bad.bin";
+    AVLTree<int> tree;
+    for (int key = 0; key < 100; ++key) {
+        tree.Insert(key);
+    }
+    tree.SaveSnapshot(path);
+
+    // flip one bit of a key
+    {
+        std::FILE *file = std::fopen(path.c_str(), "r+b");
+        ASSERT_NE(file, nullptr);
+        std::fseek(file, 64 + 40, SEEK_SET);
+        int byte = std::fgetc(file);
+        std::fseek(file, 64 + 40, SEEK_SET);
+        std::fputc(byte ^ 1, file);
+        std::fclose(file);
+    }
+    EXPECT_THROW(AVLTree<int>::LoadSnapshot(path), SnapshotFormatException);
+    EXPECT_NO_THROW(MappedSnapshot<int>(path, false));
+    EXPECT_THROW(AVLTree<int64_t>::LoadSnapshot(path),
+                 SnapshotFormatException);
+
+    // cut off the tail
+    ASSERT_EQ(truncate(path.c_str(), 100), 0);
+    EXPECT_THROW(MappedSnapshot<int>(path, false), SnapshotFormatException);
+    std::remove(path.c_str());
+    EXPECT_THROW(MappedSnapshot<int>{path}, std::system_error);
+}
+
+class DurableAVLTreeTest : public testing::Test {
+   protected:
+    const std::string base_ = testing::TempDir() + "avl_durable_test";
+
+    void SetUp() override { TearDown(); }
+
+    void TearDown() override {
+        std::remove((base_ + ".wal").c_str());
+        std::remove((base_ + ".snapshot").c_str());
+    }
+};
+
+TEST_F(DurableAVLTreeTest, RecoversFromLogAndSnapshot) {
+    std::set<int> reference_set;
+    std::mt19937 gen(47);
+    std::uniform_int_distribution<int> dist(0, 100000);
+    DurabilityOptions options{.group_size = 16, .fsync = false};
+    {
+        DurableAVLTree<int> tree(base_, options);
+        for (int i = 0; i < 3000; ++i) {
+            int key = dist(gen);
+            ASSERT_EQ(tree.Insert(key), reference_set.insert(key).second);
+            if (i == 1000) tree.Checkpoint();
+        }
+    }
+
+    DurableAVLTree<int> tree(base_, options);
+    EXPECT_EQ(tree.Size(), reference_set.size());
+    EXPECT_TRUE(tree.View().IsValid());
+    EXPECT_TRUE(std::equal(tree.View().begin(), tree.View().end(),
+                           reference_set.begin(), reference_set.end()));
+    EXPECT_EQ(tree.RangeQuery(0, 50000),
+              std::distance(reference_set.begin(),
+                            reference_set.upper_bound(50000)));
+}
+
+TEST_F(DurableAVLTreeTest, DropsTornFrame) {
+    {
+        DurableAVLTree<int> tree(base_);
+        for (int key = 0; key < 100; ++key) {
+            tree.Insert(key);
+        }
+    }
+    // half a frame, as left by a crash in the middle of a write
+    {
+        std::FILE *file = std::fopen((base_ + ".wal").c_str(), "ab");
+        ASSERT_NE(file, nullptr);
+        const char torn[10] = {5, 0, 0, 0, 0, 0, 0, 0, 1, 2};
+        std::fwrite(torn, 1, sizeof(torn), file);
+        std::fclose(file);
+    }
+    {
+        DurableAVLTree<int> tree(base_);
+        EXPECT_EQ(tree.Size(), 100);
+        tree.Insert(1000);
+    }
+    DurableAVLTree<int> tree(base_);
+    EXPECT_EQ(tree.Size(), 101);
+    EXPECT_EQ(tree.RangeQuery(1000, 1000), 1);
+}
+
+TEST_F(DurableAVLTreeTest, SnapshotAheadOfLogIsNotReplayedTwice) {
+    const std::vector<int> values = {4, 4, 2, 9, 4, 2};
+    {
+        DurableAVLMultiset<int> tree(base_);
+        for (int value : values) {
+            tree.Insert(value);
+        }
+        tree.Sync();
+        // a checkpoint that crashed before starting the log over
+        tree.View().SaveSnapshot(base_ + ".snapshot", values.size());
+    }
+    {
+        DurableAVLMultiset<int> tree(base_);
+        EXPECT_EQ(tree.Size(), 6);
+        EXPECT_EQ(tree.View().Count(4), 3);
+        tree.Insert(4);
+    }
+    DurableAVLMultiset<int> tree(base_);
+    EXPECT_EQ(tree.Size(), 7);
+    EXPECT_EQ(tree.View().Count(4), 4);
+}
+
+static_assert(sizeof(CompactNode<int>) == 16);
+static_assert(sizeof(CompactNode<double>) == 24);
+static_assert(std::is_same_v<KeyArg<int>, int>);
+static_assert(std::is_same_v<KeyArg<std::string>, const std::string &>);
+
+TEST(NodeLayoutTest, CompactNodePacksHeightWithLinks) {
+    CompactNode<int> node(7);
+    EXPECT_EQ(node.Height(), 1);
+    EXPECT_EQ(node.Left(), kNullIndex);
+    EXPECT_EQ(node.Right(), kNullIndex);
+
+    const NodeIndex max_link = CompactNode<int>::kMaxNodes - 1;
+    node.SetLeft(max_link);
+    node.SetRight(12345);
+    for (int height : {0, 5, 8, 42, 63}) {
+        node.SetHeight(height);
+        EXPECT_EQ(node.Height(), height);
+        EXPECT_EQ(node.Left(), max_link);
+        EXPECT_EQ(node.Right(), 12345);
+    }
+    node.SetChild(true, 3);
+    EXPECT_EQ(node.Left(), 3);
+    EXPECT_EQ(node.Height(), 63);
+    EXPECT_EQ(node.key_, 7);
+}
+
+TEST(NodeLayoutTest, IntTreeUsesSixteenBytesPerKey) {
+    std::vector<int> keys(1 << 18);
+    std::iota(keys.begin(), keys.end(), 0);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(53));
+    AVLTree<int> tree;
+    for (int key : keys) {
+        tree.Insert(key);
+    }
+    EXPECT_TRUE(tree.IsValid());
+    EXPECT_LE(tree.MemoryUsage(), (keys.size() + 4096) * 16);
+}
+
+TEST(AVLTreeCompareTest, DescendingOrder) {
+    AVLTree<int, std::greater<int>> tree;
+    for (int key : {5, 1, 9, 3, 7, 3}) {
+        tree.Insert(key);
+    }
+    EXPECT_TRUE(tree.IsValid());
+    EXPECT_EQ(std::vector<int>(tree.begin(), tree.end()),
+              (std::vector<int>{9, 7, 5, 3, 1}));
+    // bounds follow the comparator: 7 comes before 3
+    EXPECT_EQ(tree.RangeQuery(7, 3), 3);
+    EXPECT_EQ(tree.RangeQuery(3, 7), 0);
+    EXPECT_EQ(tree.CountLess(5), 2);
+    EXPECT_EQ(tree.Rank(1), 4);
+    EXPECT_TRUE(tree.Erase(9));
+    EXPECT_EQ(*tree.LowerBound(8), 7);
+
+    auto [high, low] = std::move(tree).Split(5);
+    EXPECT_EQ(std::vector<int>(high.begin(), high.end()),
+              (std::vector<int>{7}));
+    EXPECT_EQ(std::vector<int>(low.begin(), low.end()),
+              (std::vector<int>{5, 3, 1}));
+    auto joined = AVLTree<int, std::greater<int>>::Join(std::move(high),
+                                                        std::move(low));
+    EXPECT_EQ(joined.Size(), 4);
+    EXPECT_TRUE(joined.IsValid());
+}
+
+TEST(AVLTreeCompareTest, TransparentLookupsTakeStringViews) {
+    AVLTree<std::string, std::less<>> tree;
+    for (const char *word : {"pear", "apple", "fig", "kiwi", "banana"}) {
+        tree.Insert(word);
+    }
+    std::string_view lo = "b", hi = "kiwi";
+    EXPECT_EQ(tree.RangeQuery(lo, hi), 3);
+    EXPECT_EQ(tree.CountLess(std::string_view("fig")), 2);
+    EXPECT_EQ(tree.CountLessEqual(std::string_view("fig")), 3);
+    EXPECT_EQ(tree.Count(std::string_view("kiwi")), 1);
+    EXPECT_EQ(tree.Rank(std::string_view("pear")), 4);
+    EXPECT_EQ(*tree.UpperBound(std::string_view("c")), "fig");
+}
+
+namespace {
+
+size_t key_comparisons = 0;
+
+struct CountedKey {
+    int value;
+
+    std::strong_ordering operator<=>(const CountedKey &other) const {
+        ++key_comparisons;
+        return value <=> other.value;
+    }
+    bool operator==(const CountedKey &other) const {
+        return value == other.value;
+    }
+};
+
+}  // namespace
+
+TEST(AVLTreeCompareTest, ThreeWayComparisonOncePerLevel) {
+    AVLTree<CountedKey> tree;
+    for (int key = 0; key < 1024; ++key) {
+        tree.Insert(CountedKey{key});
+    }
+    key_comparisons = 0;
+    EXPECT_EQ(tree.Count(CountedKey{1000}), 1);
+    EXPECT_EQ(tree.Count(CountedKey{-1}), 0);
+    // an AVL tree of 1024 keys is at most 14 levels deep, one <=> per level
+    EXPECT_LE(key_comparisons, 2 * 14);
+}
+
+TEST(AVLTreeAugmentationTest, SumMinMaxMatchBruteForce) {
+    AugmentedAVLTree<int64_t, SumAugmentation<int64_t>, std::less<int64_t>,
+                     true>
+        sums;
+    AugmentedAVLTree<int64_t, MinAugmentation<int64_t>> mins;
+    AugmentedAVLTree<int64_t, MaxAugmentation<int64_t>> maxes;
+    std::multiset<int64_t> reference;
+    std::mt19937 gen(61);
+    std::uniform_int_distribution<int64_t> dist(-500, 500);
+
+    for (int step = 0; step < 4000; ++step) {
+        int64_t key = dist(gen);
+        if (step % 5 == 4) {
+            auto it = reference.find(key);
+            EXPECT_EQ(sums.Erase(key), it != reference.end());
+            if (it != reference.end()) reference.erase(it);
+            if (reference.count(key) == 0) {
+                mins.Erase(key);
+                maxes.Erase(key);
+            }
+        } else {
+            sums.Insert(key);
+            mins.Insert(key);
+            maxes.Insert(key);
+            reference.insert(key);
+        }
+
+        int64_t lo = dist(gen), hi = lo + dist(gen) / 4 + 125;
+        int64_t sum = 0, min = std::numeric_limits<int64_t>::max(),
+                max = std::numeric_limits<int64_t>::lowest();
+        for (auto it = reference.lower_bound(lo);
+             it != reference.end() && *it <= hi; ++it) {
+            sum += *it;
+            min = std::min(min, *it);
+            max = std::max(max, *it);
+        }
+        ASSERT_EQ(sums.RangeAggregate(lo, hi), sum);
+        ASSERT_EQ(mins.RangeAggregate(lo, hi), min);
+        ASSERT_EQ(maxes.RangeAggregate(lo, hi), max);
+    }
+    EXPECT_TRUE(sums.IsValid());
+    EXPECT_TRUE(mins.IsValid());
+    EXPECT_TRUE(maxes.IsValid());
+
+    auto inside = std::distance(reference.lower_bound(-100),
+                                reference.upper_bound(100));
+    EXPECT_EQ(sums.EraseRange(-100, 100), static_cast<size_t>(inside));
+    EXPECT_TRUE(sums.IsValid());
+    EXPECT_EQ(sums.RangeAggregate(-100, 100), 0);
+}
+
+namespace {
+
+// key with a payload the ordering ignores
+struct Event {
+    int time;
+    char tag;
+};
+
+struct ByTime {
+    using is_transparent = void;
+
+    bool operator()(const Event &a, const Event &b) const {
+        return a.time < b.time;
+    }
+    bool operator()(const Event &a, int b) const { return a.time < b; }
+    bool operator()(int a, const Event &b) const { return a < b.time; }
+};
+
+// concatenation is associative but not commutative, so any fold out of
+// order shows up
+struct TagString {
+    using Value = std::string;
+
+    static Value Identity() { return {}; }
+    static Value Lift(const Event &event, size_t) {
+        return std::string(1, event.tag);
+    }
+    static Value Combine(const Value &left, const Value &right) {
+        return left + right;
+    }
+};
+
+}  // namespace
+
+TEST(AVLTreeAugmentationTest, CustomMonoidFoldsInKeyOrder) {
+    AugmentedAVLTree<Event, TagString, ByTime> tree;
+    std::string tags = "abcdefghijklmnopqrstuvwxyz";
+    std::vector<int> order(tags.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937(67));
+    for (int time : order) {
+        tree.Insert(Event{time * 10, tags[time]});
+    }
+
+    EXPECT_EQ(tree.RangeAggregate(0, 1000), tags);
+    EXPECT_EQ(tree.RangeAggregate(35, 125), "efghijklm");
+    EXPECT_EQ(tree.RangeAggregate(Event{40, '?'}, Event{40, '?'}), "e");
+    EXPECT_EQ(tree.RangeAggregate(41, 49), "");
+    EXPECT_EQ(tree.RangeAggregate(100, 0), "");
+
+    tree.Erase(Event{50, '?'});
+    auto [low, high] = std::move(tree).Split(Event{130, '?'});
+    EXPECT_EQ(high.RangeAggregate(0, 1000), "nopqrstuvwxyz");
+    auto joined = decltype(low)::Join(std::move(low), std::move(high));
+    EXPECT_EQ(joined.RangeAggregate(0, 1000), "abcdeghijklmnopqrstuvwxyz");
+    EXPECT_TRUE(joined.IsValid());
+}
+
+TEST(OfflineRangeCounterTest, MatchesAVLTree) {
+    const auto keys = [] {
+        std::mt19937 gen(71);
+        std::uniform_int_distribution<int> dist(-3000, 3000);
+        std::vector<int> keys(5000);
+        for (int &key : keys) {
+            key = dist(gen);
+        }
+        return keys;
+    }();
+    OfflineRangeCounter<int> counter(keys.begin(), keys.end());
+    AVLTree<int> tree;
+
+    std::mt19937 gen(73);
+    std::uniform_int_distribution<int> bound(-3500, 3500);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        EXPECT_EQ(counter.Insert(keys[i]), tree.Insert(keys[i]));
+        int min = bound(gen), max = bound(gen);
+        ASSERT_EQ(counter.RangeQuery(min, max), tree.RangeQuery(min, max));
+        ASSERT_EQ(counter.CountLess(min), tree.CountLess(min));
+        ASSERT_EQ(counter.CountBefore(counter.UpperIndex(max)),
+                  tree.CountLessEqual(max));
+    }
+    EXPECT_EQ(counter.Size(), tree.Size());
+    EXPECT_EQ(counter.Keys(), std::vector<int>(tree.begin(), tree.end()));
+}
+
+TEST(OfflineRangeCounterTest, RejectsKeysOutsideUniverse) {
+    std::vector<int> universe = {10, 20, 30};
+    OfflineRangeCounter<int> counter(universe.begin(), universe.end());
+    EXPECT_THROW(counter.Insert(15), UnknownKeyException);
+    EXPECT_THROW(counter.Insert(31), UnknownKeyException);
+    EXPECT_TRUE(counter.Insert(30));
+    EXPECT_FALSE(counter.Insert(30));
+    EXPECT_EQ(counter.RangeQuery(-100, 100), 1);
+    EXPECT_EQ(counter.RangeQuery(31, 29), 0);
+
+    std::vector<int> empty;
+    OfflineRangeCounter<int> nothing(empty.begin(), empty.end());
+    EXPECT_EQ(nothing.RangeQuery(0, 0), 0);
+    EXPECT_THROW(nothing.Insert(0), UnknownKeyException);
+}
+
+TEST(TreeStatsTest, CountersFollowTreeEvents) {
+    AVLTree<int> tree;
+    for (int i = 0; i < 1000; ++i) {
+        tree.Insert(i);
+    }
+    EXPECT_FALSE(tree.Insert(10));
+    EXPECT_EQ(tree.RangeQuery(100, 199), 100);
+
+    TreeCounters counters = tree.Counters();
+    EXPECT_EQ(counters.max_height, 10);
+    EXPECT_EQ(counters.node_bytes, tree.MemoryUsage());
+    if constexpr (kStatsEnabled) {
+        // ascending inserts only ever rotate left
+        EXPECT_GT(counters.left_rotations, 0u);
+        EXPECT_EQ(counters.right_rotations, 0u);
+        EXPECT_EQ(counters.duplicate_inserts, 1u);
+        EXPECT_EQ(counters.range_queries, 1u);
+        EXPECT_GT(counters.nodes_visited, 0u);
+        EXPECT_LE(counters.nodes_visited, 2u * 10);
+        EXPECT_GT(counters.comparisons, counters.nodes_visited);
+    } else {
+        EXPECT_EQ(counters.comparisons, 0u);
+        EXPECT_EQ(counters.left_rotations, 0u);
+    }
+    static_assert(kStatsEnabled || std::is_empty_v<TreeStats>);
+
+    tree.ResetCounters();
+    EXPECT_EQ(tree.Counters().range_queries, 0u);
+    EXPECT_EQ(tree.Counters().max_height, 10);
+}
+
+TEST(TreeStatsTest, LatencyHistogramBuckets) {
+    LatencyHistogram histogram;
+    EXPECT_EQ(histogram.Quantile(0.5).count(), 0);
+
+    for (int i = 0; i < 99; ++i) {
+        histogram.Record(std::chrono::nanoseconds(100));
+    }
+    histogram.Record(std::chrono::nanoseconds(5000));
+
+    EXPECT_EQ(histogram.Count(), 100u);
+    EXPECT_EQ(histogram.Buckets()[7], 99u);  // [64, 128)
+    EXPECT_EQ(histogram.Buckets()[13], 1u);  // [4096, 8192)
+    EXPECT_EQ(histogram.Mean().count(), (99 * 100 + 5000) / 100);
+    EXPECT_EQ(histogram.Quantile(0.5).count(), 127);
+    EXPECT_EQ(histogram.Quantile(0.995).count(), 5000);
+    EXPECT_EQ(histogram.Max().count(), 5000);
+}
+
+TEST(SpscRingTest, KeepsOrderAcrossThreads) {
+    SpscRing<std::vector<int>, 4> ring;
+    constexpr int kItems = 20000;
+    std::thread producer([&] {
+        for (int i = 0; i < kItems; ++i) {
+            ring.Push(std::vector<int>(static_cast<size_t>(i % 3), i));
+        }
+    });
+
+    for (int i = 0; i < kItems; ++i) {
+        ASSERT_EQ(ring.Pop(), std::vector<int>(static_cast<size_t>(i % 3), i));
+    }
+    producer.join();
+}
+
+TEST(AVLTreeVersionTest, MovesOnlyWhenKeysChange) {
+    AVLTree<int> tree;
+    EXPECT_EQ(tree.Version(), 0u);
+    EXPECT_TRUE(tree.Insert(5));
+    EXPECT_TRUE(tree.Insert(7));
+    EXPECT_EQ(tree.Version(), 2u);
+    EXPECT_FALSE(tree.Insert(5));
+    EXPECT_FALSE(tree.Erase(6));
+    EXPECT_EQ(tree.EraseRange(100, 200), 0u);
+    EXPECT_EQ(tree.RangeQuery(0, 10), 2u);
+    EXPECT_EQ(tree.Version(), 2u);
+    EXPECT_TRUE(tree.Erase(5));
+    EXPECT_EQ(tree.Version(), 3u);
+
+    // a rebuild that only meets keys already present keeps the version
+    std::vector<int> present = {7, 7, 7};
+    tree.BulkLoad(present.begin(), present.end());
+    EXPECT_EQ(tree.Size(), 1u);
+    EXPECT_EQ(tree.Version(), 3u);
+    std::vector<int> fresh = {7, 8};
+    tree.BulkLoad(fresh.begin(), fresh.end());
+    EXPECT_EQ(tree.Version(), 4u);
+
+    AVLMultiset<int> multiset;
+    multiset.Insert(1);
+    multiset.Insert(1);
+    EXPECT_EQ(multiset.Version(), 2u);
+
+    // a tree moved into never reuses a version it or its source had
+    AVLTree<int> other;
+    other.Insert(1);
+    uint64_t before = tree.Version();
+    tree = std::move(other);
+    EXPECT_GT(tree.Version(), before);
+    EXPECT_GT(tree.Version(), 1u);
+}
+
+TEST(CachedAVLTreeTest, NewKeysOnlyTouchTheirWindows) {
+    CachedAVLTree<int> tree;
+    for (int key = 0; key < 100; key += 2) {
+        tree.Insert(key);
+    }
+    EXPECT_EQ(tree.RangeQuery(10, 20), 6u);
+    EXPECT_EQ(tree.RangeQuery(50, 60), 6u);
+    EXPECT_EQ(tree.RangeQuery(10, 20), 6u);
+    EXPECT_EQ(tree.CacheStats().misses, 2u);
+    EXPECT_EQ(tree.CacheStats().hits, 1u);
+
+    EXPECT_TRUE(tree.Insert(15));
+    EXPECT_FALSE(tree.Insert(16));  // a duplicate leaves the entries alone
+    EXPECT_EQ(tree.RangeQuery(10, 20), 7u);
+    EXPECT_EQ(tree.RangeQuery(50, 60), 6u);
+    CacheCounters counters = tree.CacheStats();
+    EXPECT_EQ(counters.hits, 3u);
+    EXPECT_EQ(counters.patched, 2u);
+    EXPECT_EQ(counters.misses, 2u);
+    EXPECT_EQ(counters.entries, 2u);
+
+    // more new keys than the log holds, the window is counted again
+    for (int key = 1001; key < 1201; key += 2) {
+        tree.Insert(key);
+    }
+    EXPECT_EQ(tree.RangeQuery(10, 20), 7u);
+    EXPECT_EQ(tree.CacheStats().misses, 3u);
+    EXPECT_EQ(tree.RangeQuery(60, 50), 0u);
+}
+
+TEST(CachedAVLTreeTest, RandomAgainstAVLTree) {
+    std::mt19937 gen(25);
+    std::uniform_int_distribution<int> key_dist(0, 2000);
+    std::uniform_int_distribution<int> window_dist(0, 15);
+    // few slots for many windows, so entries are evicted all the time
+    CachedAVLTree<int> cached(8);
+    CachedAVLTree<int, ArenaStorage<>, true> cached_multiset(8);
+    AVLTree<int> tree;
+    AVLMultiset<int> multiset;
+
+    for (int step = 0; step < 20000; ++step) {
+        if (gen() % 4 == 0) {
+            int key = key_dist(gen);
+            ASSERT_EQ(cached.Insert(key), tree.Insert(key));
+            cached_multiset.Insert(key);
+            multiset.Insert(key);
+            continue;
+        }
+        int min = window_dist(gen) * 120;
+        int max = min + static_cast<int>(gen() % 4) * 100 - 20;
+        ASSERT_EQ(cached.RangeQuery(min, max), tree.RangeQuery(min, max));
+        ASSERT_EQ(cached_multiset.RangeQuery(min, max),
+                  multiset.RangeQuery(min, max));
+    }
+
+    CacheCounters counters = cached.CacheStats();
+    EXPECT_GT(counters.hits, 0u);
+    EXPECT_GT(counters.patched, 0u);
+    EXPECT_GT(counters.evictions, 0u);
+    EXPECT_LE(counters.entries, 8u);
+    EXPECT_TRUE(std::equal(cached.begin(), cached.end(), tree.begin(),
+                           tree.end()));
+}
+
 }  // namespace avl_tree
 
+namespace range_queries {
+
+namespace {
+
+// feeds text through a pipe so the reader takes its buffered path
+std::vector<Command> ReadAll(const std::string &text) {
+    int fds[2];
+    EXPECT_EQ(pipe(fds), 0);
+    EXPECT_EQ(write(fds[1], text.data(), text.size()),
+              static_cast<ssize_t>(text.size()));
+    close(fds[1]);
+
+    std::vector<Command> commands;
+    try {
+        CommandReader reader(fds[0]);
+        Command command;
+        while (reader.Next(command)) {
+            commands.push_back(command);
+        }
+    } catch (...) {
+        close(fds[0]);
+        throw;
+    }
+    close(fds[0]);
+    return commands;
+}
+
+}  // namespace
+
+TEST(CommandReaderTest, ParsesCommands) {
+    auto commands = ReadAll("k 5\nq -3 +10\n\tk-7 q1 2");
+    ASSERT_EQ(commands.size(), 4);
+    EXPECT_EQ(commands[0].type, 'k');
+    EXPECT_EQ(commands[0].first, 5);
+    EXPECT_EQ(commands[1].type, 'q');
+    EXPECT_EQ(commands[1].first, -3);
+    EXPECT_EQ(commands[1].second, 10);
+    EXPECT_EQ(commands[2].first, -7);
+    EXPECT_EQ(commands[3].first, 1);
+    EXPECT_EQ(commands[3].second, 2);
+}
+
+TEST(CommandReaderTest, TokensSplitAcrossReads) {
+    // a SOCK_SEQPACKET socket returns one write per read, so the tokens
+    // "12" and "7" end the reads; "7" ends the input too and is parsed in
+    // place after the buffer grew
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds), 0);
+    for (std::string_view part : {"k 555 k 1", "2 k 7"}) {
+        ASSERT_EQ(write(fds[1], part.data(), part.size()),
+                  static_cast<ssize_t>(part.size()));
+    }
+    close(fds[1]);
+
+    std::vector<Command> commands;
+    {
+        CommandReader reader(fds[0]);
+        Command command;
+        while (reader.Next(command)) {
+            commands.push_back(command);
+        }
+    }
+    close(fds[0]);
+    ASSERT_EQ(commands.size(), 3);
+    EXPECT_EQ(commands[0].first, 555);
+    EXPECT_EQ(commands[1].first, 12);
+    EXPECT_EQ(commands[2].first, 7);
+}
+
+TEST(CommandReaderTest, RejectsMalformedInput) {
+    EXPECT_THROW(ReadAll("k x"), std::invalid_argument);
+    EXPECT_THROW(ReadAll("k 99999999999"), std::invalid_argument);
+    EXPECT_THROW(ReadAll("k +-1"), std::invalid_argument);
+    EXPECT_THROW(ReadAll("q 1"), std::invalid_argument);
+    EXPECT_THROW(ReadAll("z 1"), std::invalid_argument);
+}
+
+// the output of PipelinedIo echoing every key of input as a count, both
+// pipes are served by threads of their own so neither fills up
+std::string EchoKeys(const std::string &input, bool flush_on_query) {
+    int in[2];
+    int out[2];
+    EXPECT_EQ(pipe(in), 0);
+    EXPECT_EQ(pipe(out), 0);
+    std::thread feeder([&] {
+        EXPECT_EQ(write(in[1], input.data(), input.size()),
+                  static_cast<ssize_t>(input.size()));
+        close(in[1]);
+    });
+    std::string output;
+    std::thread drainer([&] {
+        char buffer[4096];
+        ssize_t got;
+        while ((got = read(out[0], buffer, sizeof(buffer))) > 0) {
+            output.append(buffer, static_cast<size_t>(got));
+        }
+    });
+
+    {
+        PipelinedIo io(in[0], out[1]);
+        Command command;
+        try {
+            while (io.Next(command)) {
+                if (command.type == 'k') {
+                    io.WriteCount(static_cast<size_t>(command.first));
+                } else if (flush_on_query) {
+                    io.Flush();
+                }
+            }
+            io.WriteChar('\n');
+        } catch (const std::invalid_argument &) {
+            io.WriteChar('!');
+        }
+    }
+    close(out[1]);
+    feeder.join();
+    drainer.join();
+    close(in[0]);
+    close(out[0]);
+    return output;
+}
+
+TEST(PipelinedIoTest, KeepsCommandAndAnswerOrder) {
+    std::string input;
+    std::string expected;
+    for (int i = 0; i < 10000; ++i) {
+        input += "k " + std::to_string(i) + (i % 7 == 0 ? " q 1 2 " : " ");
+        expected += std::to_string(i) + " ";
+    }
+    EXPECT_EQ(EchoKeys(input, false), expected + "\n");
+    EXPECT_EQ(EchoKeys(input, true), expected + "\n");
+}
+
+TEST(PipelinedIoTest, ReportsBadInputAfterTheCommandsBeforeIt) {
+    EXPECT_EQ(EchoKeys("k 1 k 2 k x k 3", false), "1 2 !");
+    EXPECT_EQ(EchoKeys("", false), "\n");
+}
+
+}  // namespace range_queries
+
 int main(int argc, char **argv) {
     google::InitGoogleLogging(argv[0]);
     FLAGS_logtostderr = 1;
@@ -3,6 +3,9 @@
 EXECUTABLE=$1
 INPUT_FILE=$2
 EXPECTED_OUTPUT_FILE=$3
+shift 3
+# anything after the expected output is passed to the executable
+EXTRA_ARGS=("$@")
 
 
 if [ ! -x "$EXECUTABLE" ]; then
@@ -26,7 +29,7 @@ TEMP_OUTPUT_FILE=$(mktemp --suffix=.test_output)
 trap "rm -f $TEMP_OUTPUT_FILE" EXIT
 
 
-"$EXECUTABLE" < "$INPUT_FILE" > "$TEMP_OUTPUT_FILE"
+"$EXECUTABLE" "${EXTRA_ARGS[@]}" < "$INPUT_FILE" > "$TEMP_OUTPUT_FILE"
 EXEC_RET_CODE=$?
 
 